@@ -0,0 +1,51 @@
+//               Copyright 2017 Juha Reunanen
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "connection_pool.h"
+#include <algorithm>
+
+namespace isto {
+
+    ConnectionPool::ConnectionPool(const std::string& path, size_t connectionCount)
+    {
+        const int busyTimeoutMilliseconds = 10000; // readers are rarely blocked in WAL mode, but it may happen during a checkpoint
+
+        for (size_t i = 0; i < connectionCount; ++i) {
+            connections.push_back(std::unique_ptr<SQLite::Database>(new SQLite::Database(path, SQLITE_OPEN_READONLY, busyTimeoutMilliseconds)));
+        }
+
+        for (auto& connection : connections) {
+            availableConnections.push_back(&connection);
+        }
+    }
+
+    std::unique_ptr<SQLite::Database>& ConnectionPool::Acquire()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        connectionAvailable.wait(lock, [this]() { return !availableConnections.empty(); });
+
+        auto* connection = availableConnections.back();
+        availableConnections.pop_back();
+        return *connection;
+    }
+
+    void ConnectionPool::Release(std::unique_ptr<SQLite::Database>& connection)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            availableConnections.push_back(&connection);
+        }
+
+        connectionAvailable.notify_one();
+    }
+
+    bool ConnectionPool::Owns(const std::unique_ptr<SQLite::Database>& connection) const
+    {
+        return std::any_of(connections.begin(), connections.end(), [&connection](const std::unique_ptr<SQLite::Database>& c) { return &c == &connection; });
+    }
+
+};
@@ -0,0 +1,38 @@
+//               Copyright 2017 Juha Reunanen
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef ISTO_CONNECTION_POOL_H
+#define ISTO_CONNECTION_POOL_H
+
+#include <SQLiteCpp/Database.h>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+namespace isto {
+
+    // A fixed number of read-only connections to a database in WAL mode, shared by the reading threads
+    class ConnectionPool {
+    public:
+        ConnectionPool(const std::string& path, size_t connectionCount);
+
+        // Waits until a connection is available
+        std::unique_ptr<SQLite::Database>& Acquire();
+        void Release(std::unique_ptr<SQLite::Database>& connection);
+
+        bool Owns(const std::unique_ptr<SQLite::Database>& connection) const;
+
+    private:
+        std::vector<std::unique_ptr<SQLite::Database>> connections;
+        std::vector<std::unique_ptr<SQLite::Database>*> availableConnections;
+        std::mutex mutex;
+        std::condition_variable connectionAvailable;
+    };
+
+};
+
+#endif // ISTO_CONNECTION_POOL_H
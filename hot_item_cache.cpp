@@ -0,0 +1,78 @@
+//               Copyright 2017 Juha Reunanen
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "hot_item_cache.h"
+
+namespace isto {
+
+    HotItemCache::HotItemCache(uintmax_t capacityInBytes)
+        : capacityInBytes(capacityInBytes)
+    {}
+
+    DataItem HotItemCache::Get(const std::string& id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        const auto i = itemsById.find(id);
+        if (i == itemsById.end()) {
+            return DataItem::Invalid();
+        }
+
+        items.splice(items.begin(), items, i->second); // mark as the most recently used
+        return *i->second;
+    }
+
+    void HotItemCache::Put(const DataItem& dataItem)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        EraseItem(dataItem.id);
+
+        const uintmax_t size = dataItem.data.size();
+        if (!IsEnabled() || size > capacityInBytes) {
+            return;
+        }
+
+        EraseLeastRecentlyUsedUntilFits(size);
+
+        items.push_front(dataItem); // NB: copying a data item does not copy the payload
+        itemsById.emplace(dataItem.id, items.begin());
+        currentBytes += size;
+    }
+
+    void HotItemCache::Erase(const std::string& id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        EraseItem(id);
+    }
+
+    void HotItemCache::EraseItem(const std::string& id)
+    {
+        const auto i = itemsById.find(id);
+        if (i != itemsById.end()) {
+            currentBytes -= i->second->data.size();
+            items.erase(i->second);
+            itemsById.erase(i);
+        }
+    }
+
+    void HotItemCache::Clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        items.clear();
+        itemsById.clear();
+        currentBytes = 0;
+    }
+
+    void HotItemCache::EraseLeastRecentlyUsedUntilFits(uintmax_t size)
+    {
+        while (!items.empty() && currentBytes + size > capacityInBytes) {
+            EraseItem(items.back().id);
+        }
+    }
+
+};
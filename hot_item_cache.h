@@ -0,0 +1,48 @@
+//               Copyright 2017 Juha Reunanen
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef ISTO_HOT_ITEM_CACHE_H
+#define ISTO_HOT_ITEM_CACHE_H
+
+#include "isto.h"
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace isto {
+
+    // Keeps the most recently saved or read data items in memory, up to a total payload size
+    // - the least recently used items are dropped first
+    // - thread-safe, because the items may be read concurrently (see Configuration::readConnectionCount)
+    class HotItemCache {
+    public:
+        HotItemCache(uintmax_t capacityInBytes);
+
+        // Returns DataItem::Invalid() if the item is not in the cache
+        DataItem Get(const std::string& id);
+
+        void Put(const DataItem& dataItem);
+        void Erase(const std::string& id);
+        void Clear();
+
+        bool IsEnabled() const { return capacityInBytes > 0; }
+
+    private:
+        void EraseItem(const std::string& id);
+        void EraseLeastRecentlyUsedUntilFits(uintmax_t size);
+
+        const uintmax_t capacityInBytes;
+        uintmax_t currentBytes = 0;
+
+        std::list<DataItem> items; // the most recently used item first
+        std::unordered_map<std::string, std::list<DataItem>::iterator> itemsById;
+
+        std::mutex mutex;
+    };
+
+};
+
+#endif // ISTO_HOT_ITEM_CACHE_H
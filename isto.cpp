@@ -6,25 +6,82 @@
 
 #include "isto.h"
 #include "isto_impl.h"
+#include "query_impl.h"
 
-#include "system_clock_time_point_string_conversion/system_clock_time_point_string_conversion.h"
-
+#include <algorithm> // std::equal
 #include <assert.h>
 
 namespace isto {
     timestamp_t now() { return std::chrono::system_clock::now(); }
 
     timestamp_t RoundToUsedPrecision(const timestamp_t timestamp) {
-        const timestamp_t rounded = system_clock_time_point_string_conversion::from_string(system_clock_time_point_string_conversion::to_string(timestamp));
-        assert(abs(std::chrono::duration_cast<std::chrono::microseconds>(timestamp - rounded).count()) < 1);
-        return system_clock_time_point_string_conversion::from_string(system_clock_time_point_string_conversion::to_string(timestamp));
+        // The timestamps are stored as microseconds
+        return std::chrono::time_point_cast<timestamp_t::duration>(std::chrono::floor<std::chrono::microseconds>(timestamp));
+    }
+
+    Payload::Payload()
+        : begin_(nullptr)
+        , size_(0)
+    {}
+
+    Payload::Payload(std::vector<unsigned char>&& data)
+    {
+        const auto vector = std::make_shared<const std::vector<unsigned char>>(std::move(data));
+        owner = vector;
+        begin_ = vector->data();
+        size_ = vector->size();
     }
 
+    Payload::Payload(const std::vector<unsigned char>& data)
+        : Payload(std::vector<unsigned char>(data))
+    {}
+
+    Payload::Payload(const std::string& data)
+        : Payload(std::vector<unsigned char>(data.begin(), data.end()))
+    {}
+
+    Payload::Payload(const char* dataBegin, const char* dataEnd)
+        : Payload(std::vector<unsigned char>(dataBegin, dataEnd))
+    {}
+
+    Payload::Payload(const std::shared_ptr<const void>& owner, const unsigned char* data, size_t size)
+        : owner(owner)
+        , begin_(data)
+        , size_(size)
+    {}
+
+    bool operator==(const Payload& lhs, const Payload& rhs)
+    {
+        return lhs.size() == rhs.size() && (lhs.data() == rhs.data() || std::equal(lhs.begin(), lhs.end(), rhs.begin()));
+    }
+
+    bool operator==(const Payload& lhs, const std::vector<unsigned char>& rhs)
+    {
+        return lhs.size() == rhs.size() && std::equal(lhs.begin(), lhs.end(), rhs.begin());
+    }
+
+    bool operator==(const std::vector<unsigned char>& lhs, const Payload& rhs) { return rhs == lhs; }
+    bool operator!=(const Payload& lhs, const Payload& rhs) { return !(lhs == rhs); }
+    bool operator!=(const Payload& lhs, const std::vector<unsigned char>& rhs) { return !(lhs == rhs); }
+    bool operator!=(const std::vector<unsigned char>& lhs, const Payload& rhs) { return !(lhs == rhs); }
+
     DataItem::DataItem(const std::string& id, const char* dataBegin, const char* dataEnd, const timestamp_t& timestamp, bool isPermanent, const tags_t& tags)
-        : DataItem(id, std::vector<unsigned char>(dataBegin, dataEnd), timestamp, isPermanent, tags)
+        : DataItem(id, Payload(dataBegin, dataEnd), timestamp, isPermanent, tags)
     {}
 
     DataItem::DataItem(const std::string& id, const std::vector<unsigned char>& data, const timestamp_t& timestamp, bool isPermanent, const tags_t& tags)
+        : DataItem(id, Payload(data), timestamp, isPermanent, tags)
+    {}
+
+    DataItem::DataItem(const std::string& id, std::vector<unsigned char>&& data, const timestamp_t& timestamp, bool isPermanent, const tags_t& tags)
+        : DataItem(id, Payload(std::move(data)), timestamp, isPermanent, tags)
+    {}
+
+    DataItem::DataItem(const std::string& id, const std::string& data, const timestamp_t& timestamp, bool isPermanent, const tags_t& tags)
+        : DataItem(id, Payload(data), timestamp, isPermanent, tags)
+    {}
+
+    DataItem::DataItem(const std::string& id, const Payload& data, const timestamp_t& timestamp, bool isPermanent, const tags_t& tags)
         : id(id)
         , data(data)
         , timestamp(RoundToUsedPrecision(timestamp))
@@ -33,10 +90,6 @@ namespace isto {
         , tags(tags)
     {}
 
-    DataItem::DataItem(const std::string& id, const std::string& data, const timestamp_t& timestamp, bool isPermanent, const tags_t& tags)
-        : DataItem(id, std::vector<unsigned char>(data.begin(), data.end()), timestamp, isPermanent, tags)
-    {}
-
     DataItem DataItem::Invalid()
     {
         return DataItem();
@@ -68,11 +121,21 @@ namespace isto {
         impl->SaveData(dataItems, upsert);
     }
 
+    std::future<bool> Storage::SaveDataAsync(const DataItem& dataItem, bool upsert)
+    {
+        return impl->SaveDataAsync(dataItem, upsert);
+    }
+
     DataItem Storage::GetData(const std::string& id)
     {
         return impl->GetData(id);
     }
 
+    DataView Storage::GetDataView(const std::string& id)
+    {
+        return impl->GetDataView(id);
+    }
+
     DataItem Storage::GetData(const std::chrono::system_clock::time_point& timestamp, const std::string& comparisonOperator, const tags_t& tags)
     {
         return impl->GetData(timestamp, comparisonOperator, tags);
@@ -83,23 +146,62 @@ namespace isto {
         return impl->GetDataItems(startTime, endTime, tags, maxItems, order);
     }
 
+    DataItemMetadataItems Storage::GetMetadataItems(const timestamp_t& startTime, const timestamp_t& endTime, const tags_t& tags, const size_t maxItems, Order order)
+    {
+        return impl->GetMetadataItems(startTime, endTime, tags, maxItems, order);
+    }
+
+    DataItem Storage::GetData(const DataItemMetadata& metadata)
+    {
+        return impl->GetData(metadata);
+    }
+
     bool Storage::MakePermanent(const std::string& id)
     {
         return impl->MakePermanent(id);
     }
 
+    size_t Storage::MakePermanent(const std::vector<std::string>& ids)
+    {
+        return impl->MakePermanent(ids);
+    }
+
     bool Storage::MakeRotating(const std::string& id)
     {
         return impl->MakeRotating(id);
     }
 
+    bool Storage::Pin(const std::string& id)
+    {
+        return impl->Pin(id);
+    }
+
     std::deque<std::string> Storage::GetIdsSortedByAscendingTimestamp(const std::string& timestampBegin, const std::string& timestampEnd) const
     {
         return impl->GetIdsSortedByAscendingTimestamp(timestampBegin, timestampEnd);
     }
 
+    void Storage::Flush()
+    {
+        impl->Flush();
+    }
+
     void Storage::SetRotatingDataDeletedCallback(const rotating_data_deleted_callback_t& callback)
     {
         return impl->SetRotatingDataDeletedCallback(callback);
     }
+
+    Storage::Query::Query(Storage& storage, const timestamp_t& startTime, const timestamp_t& endTime, const tags_t& tags, Order order, size_t readAheadItems)
+        : impl(new Impl(*storage.impl, startTime, endTime, tags, order, readAheadItems))
+    {}
+
+    Storage::Query::~Query()
+    {
+        delete impl;
+    }
+
+    DataItem Storage::Query::Next()
+    {
+        return impl->Next();
+    }
 }
\ No newline at end of file
@@ -13,6 +13,8 @@
 #include <deque>
 #include <unordered_map>
 #include <functional>
+#include <future>
+#include <memory>
 
 namespace isto {
     
@@ -23,15 +25,57 @@ namespace isto {
 
     timestamp_t now();
 
+    // An immutable, reference-counted buffer - copying a payload (or a data item) does not copy the bytes
+    class Payload {
+    public:
+        typedef unsigned char value_type;
+        typedef const unsigned char* const_iterator;
+        typedef const_iterator iterator;
+
+        Payload();
+        Payload(std::vector<unsigned char>&& data); // adopts the vector, without copying the bytes
+        Payload(const std::vector<unsigned char>& data);
+        Payload(const std::string& data);
+        Payload(const char* dataBegin, const char* dataEnd);
+
+        // Shares any buffer that is kept alive by the owner
+        Payload(const std::shared_ptr<const void>& owner, const unsigned char* data, size_t size);
+
+        const unsigned char* data() const { return begin_; }
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+
+        const_iterator begin() const { return begin_; }
+        const_iterator end() const { return begin_ + size_; }
+
+        const unsigned char& operator[](size_t index) const { return begin_[index]; }
+
+        std::vector<unsigned char> ToVector() const { return std::vector<unsigned char>(begin(), end()); }
+
+    private:
+        std::shared_ptr<const void> owner;
+        const unsigned char* begin_;
+        size_t size_;
+    };
+
+    bool operator==(const Payload& lhs, const Payload& rhs);
+    bool operator==(const Payload& lhs, const std::vector<unsigned char>& rhs);
+    bool operator==(const std::vector<unsigned char>& lhs, const Payload& rhs);
+    bool operator!=(const Payload& lhs, const Payload& rhs);
+    bool operator!=(const Payload& lhs, const std::vector<unsigned char>& rhs);
+    bool operator!=(const std::vector<unsigned char>& lhs, const Payload& rhs);
+
     struct DataItem {
         DataItem(const std::string& id, const char* dataBegin, const char* dataEnd, const timestamp_t& timestamp = now(), bool isPermanent = false, const tags_t& tags = tags_t());
         DataItem(const std::string& id, const std::vector<unsigned char>& data, const timestamp_t& timestamp = now(), bool isPermanent = false, const tags_t& tags = tags_t());
+        DataItem(const std::string& id, std::vector<unsigned char>&& data, const timestamp_t& timestamp = now(), bool isPermanent = false, const tags_t& tags = tags_t());
         DataItem(const std::string& id, const std::string& data, const timestamp_t& timestamp = now(), bool isPermanent = false, const tags_t& tags = tags_t());
+        DataItem(const std::string& id, const Payload& data, const timestamp_t& timestamp = now(), bool isPermanent = false, const tags_t& tags = tags_t());
 
         static DataItem Invalid();
 
         const std::string id; // for example, a guid (NB: should qualify as a filename too!)
-        const std::vector<unsigned char> data;
+        const Payload data;
         const timestamp_t timestamp;
         const bool isPermanent;
         const bool isValid;
@@ -44,6 +88,20 @@ namespace isto {
 
     typedef std::vector<DataItem> DataItems;
 
+    // Everything about a data item, except the payload
+    struct DataItemMetadata {
+        std::string id;
+        timestamp_t timestamp;
+        bool isPermanent = false;
+        size_t size = 0; // the size of the payload
+        tags_t tags;
+    };
+
+    typedef std::vector<DataItemMetadata> DataItemMetadataItems;
+
+    // A data item whose payload is a read-only view to a memory-mapped file
+    typedef DataItem DataView;
+
     struct Configuration {
 #ifdef _WIN32
         std::string rotatingDirectory = ".\\data\\rotating";
@@ -56,10 +114,80 @@ namespace isto {
         double maxRotatingDataToKeepInGiB = 100.0;
         double minFreeDiskSpaceInGiB = 0.5;
 
+        // The free disk space is not queried on every save, but estimated from the bytes written and deleted
+        // - the estimate is re-synced with the file system every freeDiskSpaceCheckIntervalSeconds, and whenever
+        //   it gets within freeDiskSpaceSafetyMarginInGiB of the free space limit
+        double freeDiskSpaceCheckIntervalSeconds = 10.0;
+        double freeDiskSpaceSafetyMarginInGiB = 1.0;
+
         std::vector<std::string> tags; // tags are string values like "camera": "1" or "detected_size": "too large"
 
+        // Tags, or combinations of tags, that get an index together with the timestamp - for example, { { "camera" } }
+        // - speeds up the queries that filter by (at least the first of) these tags
+        // - the indexes are created, and any indexes no longer listed are dropped, when the storage is constructed
+        std::vector<std::vector<std::string>> tagIndexes;
+
+        // Instead of a column per tag listed above, store the tags of each item in separate tables
+        // - any tag names can be used, and new ones can be introduced at any time
+        // - each distinct tag name and value is stored only once, and referred to by an integer id
+        // - NB: tags and tagIndexes must be left empty
+        bool useDynamicTags = false;
+
+        // Limits for the rotating data that has a particular tag value, in addition to the overall limits above
+        // - for example, { "camera", "3", 20.0, 24.0 } keeps at most 20 GiB, and at most 24 hours, of the data tagged camera=3
+        // - zero means no limit
+        // - with static tags, the tag must be one of the tags above, and gets an index together with the timestamp
+        struct RotatingDataQuota {
+            std::string tag;
+            std::string value;
+            double maxDataToKeepInGiB = 0.0;
+            double maxAgeInHours = 0.0;
+        };
+
+        std::vector<RotatingDataQuota> rotatingDataQuotas;
+
+        // Tiers for the rotating data, from the fastest (and smallest) to the slowest (and largest)
+        // - for example, { { "/mnt/nvme/isto", 100.0 }, { "/mnt/hdd/isto", 0.0 } }
+        // - the new data is saved to the first tier, and a background thread moves the oldest data of each tier that
+        //   holds more than its maxDataInGiB down to the next tier (the maxDataInGiB of the last tier is not used)
+        // - the data is deleted from the last tier according to the limits above, which apply to all the tiers together
+        // - the database remains in rotatingDirectory
+        // - NB: cannot be used together with segment files
+        struct RotatingTier {
+            std::string directory;
+            double maxDataInGiB = 0.0;
+        };
+
+        std::vector<RotatingTier> rotatingTiers;
+
+        // Directories on separate volumes that the rotating data is distributed to, in order to add write bandwidth
+        // - when non-empty, used instead of rotatingDirectory for the payloads (the database remains in rotatingDirectory)
+        // - the free disk space limits apply to each of the volumes
+        // - NB: cannot be used together with rotating tiers, or segment files
+        std::vector<std::string> rotatingStripes;
+
+        enum class StripingPolicy {
+            RoundRobin, // each volume in turn
+            LeastFull   // the volume with the most free space
+        };
+
+        StripingPolicy stripingPolicy = StripingPolicy::RoundRobin;
+
         unsigned int deletionFlushInterval = 1000;
 
+        // Delete rotating data in a background thread, before the limits above are reached
+        // - the deletion starts when the rotating data exceeds evictionHighWatermark * maxRotatingDataToKeepInGiB,
+        //   or when the free disk space falls below evictionStartFreeDiskPercent of the disk
+        // - the oldest data is then deleted in batches of deletionFlushInterval items, until the rotating data is
+        //   below evictionLowWatermark * maxRotatingDataToKeepInGiB and at least evictionStopFreeDiskPercent is free
+        // - the saves wait for data to be deleted only if the limits above would still be exceeded
+        // - NB: the rotating-data-deleted callback is then invoked from the background thread, too
+        bool useBackgroundEviction = false;
+        double evictionHighWatermark = 0.95;
+        double evictionLowWatermark = 0.9;
+        double evictionStartFreeDiskPercent = 5.0;
+        double evictionStopFreeDiskPercent = 10.0;
+
         enum class DirectoryStructureResolution {
             Unspecified = 0,
 
@@ -73,7 +201,81 @@ namespace isto {
 
         DirectoryStructureResolution directoryStructureResolution = DirectoryStructureResolution::Minutes;
 
+        // Pin the rotating items whose files have been made read-only (see Storage::Pin)
+        // - the files are scanned once, when the storage is constructed; a file made read-only later on is
+        //   not noticed until the next construction, so prefer Storage::Pin
+        // - the scan checks every rotating file, so turn this off to speed up the construction of a large storage
         bool makeReadOnlyFilesPermanent = true;
+
+        // The number of threads used to read, write, and delete files
+        unsigned int ioThreadCount = 8;
+
+        // The metadata of saved items is committed to the databases after this many items, milliseconds,
+        // or bytes - whichever comes first (0 = no limit)
+        // - committing less often is faster, but more metadata may be lost if the process crashes
+        // - uncommitted metadata is always committed by Storage::Flush, and when the Storage is destructed
+        unsigned int commitIntervalItems = 1;
+        unsigned int commitIntervalMilliseconds = 0;
+        uintmax_t commitIntervalBytes = 0;
+
+        // Put the databases in write-ahead logging (WAL) mode, and read them through a pool of this many read-only
+        // connections per database (0 = read through the single connection that writes, as before)
+        // - the Get* functions can then run concurrently from many threads, without waiting for the saving and
+        //   the deletion of items, nor holding them up
+        // - NB: the reads see only committed metadata (see commitIntervalItems etc.)
+        unsigned int readConnectionCount = 0;
+
+        // Attach to an existing storage that is owned by another (writer) process, e.g. a viewer or an exporter
+        // - nothing is created, and no write locks are taken; saving or moving items throws
+        // - each read sees the metadata most recently committed by the writer
+        // - NB: the writer must use readConnectionCount > 0 or rotatingMetadataPartitioning, so that the databases
+        //   are in WAL mode and not locked for the duration of its transactions
+        // - the hot item cache is not used, because it could not be kept up to date
+        bool readOnly = false;
+
+        // Keep the metadata of the rotating data in one database per day or hour (e.g., isto_rotating_2026-10-16.sqlite,
+        // in UTC), instead of the single ever-growing isto_rotating.sqlite
+        // - the indexes stay small no matter how long the storage runs, and the queries only visit the partitions that
+        //   overlap the requested time range
+        // - the oldest partition is dropped as a whole file, once all of its data would be deleted anyway
+        // - NB: looking up or upserting an item by id checks each partition, so prefer days unless they would be huge
+        // - any items in isto_rotating.sqlite are moved to the partitions when the storage is constructed
+        // - the databases are kept in WAL mode, so that a read-only reader (see readOnly) can attach; the reader
+        //   notices the partitions that the writer creates or drops within a second
+        // - cannot be used together with readConnectionCount, nor disabled again once partitions exist
+        enum class RotatingMetadataPartitioning {
+            None,
+            Hours,
+            Days
+        };
+
+        RotatingMetadataPartitioning rotatingMetadataPartitioning = RotatingMetadataPartitioning::None;
+
+        // The partitions are opened only when needed, and committed and closed again once they have not been used
+        // for this long - except for the newest one, which the saves go to
+        double idleRotatingPartitionCloseSeconds = 60.0;
+
+        // Instead of writing each data item to a file of its own, append the payloads to large segment
+        // files, one or more per directory (see directoryStructureResolution)
+        // - saves lots of inodes and directory lookups when storing many small items
+        // - the disk space is reclaimed once all the items in a segment have been deleted
+        bool useSegmentFiles = false;
+        double segmentFileSizeInMiB = 64.0;
+
+        // Items passed to SaveDataAsync are queued in memory, and saved by a dedicated writer thread
+        size_t asyncSaveQueueCapacity = 1000;
+
+        enum class AsyncSaveQueueFullPolicy {
+            Block,      // wait until the writer thread has made room in the queue
+            DropOldest, // discard the oldest queued item (its future yields false)
+            Fail        // do not queue the new item (its future yields false)
+        };
+
+        AsyncSaveQueueFullPolicy asyncSaveQueueFullPolicy = AsyncSaveQueueFullPolicy::Block;
+
+        // Keep recently saved and read data items in memory, so that GetData(id) can serve them
+        // without querying the databases or reading the disk (0 = no cache)
+        double hotItemCacheSizeInMiB = 0.0;
     };
 
     enum class Order {
@@ -91,9 +293,21 @@ namespace isto {
 
         void SaveData(const DataItems& dataItems, bool upsert = false);
 
+        // Queue data to be saved in the background, and return immediately
+        // - the future yields true once the data has been saved, or false if it was not saved
+        //   (because of lack of space, or because the queue was full - see Configuration)
+        // - errors (such as trying to insert duplicate data) are reported via the future, too
+        // - any items still in the queue are saved before the destructor returns
+        std::future<bool> SaveDataAsync(const DataItem& dataItem, bool upsert = false);
+
         // Get data by id
         DataItem GetData(const std::string& id);
 
+        // Get data by id, without reading the payload into memory
+        // - the payload is mapped for as long as any copy of the view, or its payload, exists
+        // - NB: on Windows, a file cannot be deleted while mapped, so keep the views short-lived
+        DataView GetDataView(const std::string& id);
+
         // Get data by timestamp
         // - supported comparison operators: "<", "<=", "==", ">=", ">", "~" (nearest)
         DataItem GetData(const timestamp_t& timestamp = std::chrono::system_clock::now(), const std::string& comparisonOperator = "~", const tags_t& tags = tags_t());
@@ -107,16 +321,69 @@ namespace isto {
             Order order = Order::DontCare
         );
 
+        // Like GetDataItems, but without reading any payloads - only the databases are queried
+        DataItemMetadataItems GetMetadataItems(
+            const timestamp_t& startTime = timestamp_t(),
+            const timestamp_t& endTime = std::chrono::system_clock::now(),
+            const tags_t& tags = tags_t(),
+            const size_t maxItems = 1000,
+            Order order = Order::DontCare
+        );
+
+        // Read the payload of an item found using GetMetadataItems
+        DataItem GetData(const DataItemMetadata& metadata);
+
+        // Read the data items of a time range (start time and end time are both inclusive) one at a time,
+        // so that arbitrarily long ranges can be walked with constant memory
+        // - up to readAheadItems payloads are read in the background, ahead of the caller
+        // - items saved or deleted while the query is being walked may or may not be returned
+        // - NB: the query must not outlive the storage
+        class Query {
+        public:
+            Query(
+                Storage& storage,
+                const timestamp_t& startTime = timestamp_t(),
+                const timestamp_t& endTime = std::chrono::system_clock::now(),
+                const tags_t& tags = tags_t(),
+                Order order = Order::Ascending,
+                size_t readAheadItems = 4
+            );
+            ~Query();
+
+            // Returns DataItem::Invalid() once all the matching items have been read
+            DataItem Next();
+
+        private:
+            Query(const Query&) = delete;
+            Query& operator=(const Query&) = delete;
+
+            class Impl;
+            Impl* impl;
+        };
+
         // Keep a certain data item forever
         // - for example, if manually labeled in a supervised training setting
         bool MakePermanent(const std::string& id);
 
+        // Keep several data items forever, with one transaction per database
+        // - returns the number of items that were made permanent
+        size_t MakePermanent(const std::vector<std::string>& ids);
+
         // Unmake permanent
         bool MakeRotating(const std::string& id);
 
+        // Make a rotating data item permanent when it would otherwise be deleted to make room
+        // - returns false if there is no such rotating data item
+        // - NB: upserting the item clears the pin
+        bool Pin(const std::string& id);
+
         // Leave timestamps empty in order not to limit the search
         std::deque<std::string> GetIdsSortedByAscendingTimestamp(const std::string& timestampBegin = "", const std::string& timestampEnd = "") const;
 
+        // Commit any uncommitted metadata now (see Configuration::commitIntervalItems etc.)
+        void Flush();
+
+        // NB: when using SaveDataAsync, the callback may be invoked from the writer thread
         void SetRotatingDataDeletedCallback(const rotating_data_deleted_callback_t& callback);
 
     private:
@@ -10,36 +10,205 @@
 #include "system_clock_time_point_string_conversion/system_clock_time_point_string_conversion.h"
 #include <filesystem>
 #include <numeric> // std::accumulate
+#include <algorithm> // std::max
 #include <fstream>
 #include <sstream>
+#include <cctype> // ::tolower
 #include <unordered_set>
+#include <map>
+#include <set>
+#include <limits>
+#include <cstdio> // std::sscanf
 #include <assert.h>
 
 namespace isto {
     namespace fs = std::filesystem;
 
+    // The timestamps are stored in the databases as microseconds since the epoch
+    int64_t ToMicroseconds(const timestamp_t& timestamp)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(timestamp.time_since_epoch()).count();
+    }
+
+    timestamp_t FromMicroseconds(int64_t microseconds)
+    {
+        return timestamp_t(std::chrono::duration_cast<timestamp_t::duration>(std::chrono::microseconds(microseconds)));
+    }
+
+    void RemoveFileAndEmptyParentDirectories(fs::path path);
+
     Storage::Impl::Impl(const Configuration& configuration)
         : configuration(configuration)
+        , ioThreadPool(configuration.ioThreadCount)
+        , hotItemCache(configuration.readOnly ? 0 : static_cast<uintmax_t>(configuration.hotItemCacheSizeInMiB * 1024 * 1024)) // the writer could not invalidate it
     {
+        if (configuration.readOnly) {
+            OpenDatabasesReadOnly();
+            CreateConnectionPoolsIfNeeded();
+            return;
+        }
+
         CreateDirectoriesThatDoNotExist();
         CreateDatabases();
-        CreateTablesThatDoNotExist();
-        CreateIndexesThatDoNotExist();
+        CreateTablesThatDoNotExist(GetAllDatabases());
+        AddColumnsThatDoNotExist(GetAllDatabases());
+        ConvertTextTimestampsToIntegers();
+        CreateIndexesThatDoNotExist(GetAllDatabases());
         CreateStatements();
+        MoveUnpartitionedRotatingItems();
         InitializeCurrentDataItemBytes();
+        CreateRotatingVolumes();
+        PinReadOnlyFilesIfNeeded();
+
+        if (configuration.readConnectionCount > 0 || IsRotatingMetadataPartitioned()) {
+            // The readers (see Configuration::readOnly) must see the tables and the columns that may have just been created
+            FlushRotating();
+            FlushPermanent();
+        }
+
+        CreateConnectionPoolsIfNeeded();
+        CloseIdleRotatingPartitions(0.0); // the construction has visited each partition, but won't need them any more
+        StartCommitThreadIfNeeded();
+        StartEvictionThreadIfNeeded();
+    }
+
+    Storage::Impl::~Impl()
+    {
+        StopAsyncSaveThread();
+        StopEvictionThread();
+        StopCommitThread();
+
+        try {
+            RetireSegment(activeRotatingSegment);
+            RetireSegment(activePermanentSegment);
+        }
+        catch (std::exception&) {
+            // nothing we can do here
+        }
+
+        try {
+            // Commit only pending metadata - a Storage that saved nothing leaves the databases untouched
+            if (uncommittedPermanent.items > 0) {
+                FlushPermanent();
+            }
+            if (uncommittedRotating.items > 0) {
+                FlushRotating();
+            }
+        }
+        catch (std::exception&) {
+            // nothing we can do here
+        }
     }
 
     bool Storage::Impl::SaveData(const DataItem& dataItem, bool upsert)
     {
-        return SaveData(&dataItem, 1, upsert);
+        ThrowIfReadOnly();
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        const bool saved = SaveData(&dataItem, 1, upsert);
+        CloseIdleRotatingPartitions(configuration.idleRotatingPartitionCloseSeconds);
+        return saved;
     }
 
     bool Storage::Impl::SaveData(const DataItems& dataItems, bool upsert)
     {
+        ThrowIfReadOnly();
         if (dataItems.empty()) {
             return false;
         }
-        return SaveData(&dataItems[0], dataItems.size(), upsert);
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        const bool saved = SaveData(&dataItems[0], dataItems.size(), upsert);
+        CloseIdleRotatingPartitions(configuration.idleRotatingPartitionCloseSeconds);
+        return saved;
+    }
+
+    std::future<bool> Storage::Impl::SaveDataAsync(const DataItem& dataItem, bool upsert)
+    {
+        ThrowIfReadOnly();
+
+        auto request = std::make_unique<AsyncSaveRequest>(dataItem, upsert);
+        auto saved = request->saved.get_future();
+
+        {
+            std::unique_lock<std::mutex> lock(asyncSaveQueueMutex);
+
+            const size_t capacity = std::max(configuration.asyncSaveQueueCapacity, static_cast<size_t>(1));
+
+            if (asyncSaveQueue.size() >= capacity) {
+                switch (configuration.asyncSaveQueueFullPolicy) {
+                case Configuration::AsyncSaveQueueFullPolicy::Block:
+                    asyncSaveQueueNotFull.wait(lock, [&]() { return asyncSaveQueue.size() < capacity; });
+                    break;
+                case Configuration::AsyncSaveQueueFullPolicy::DropOldest:
+                    asyncSaveQueue.front()->saved.set_value(false);
+                    asyncSaveQueue.pop_front();
+                    break;
+                case Configuration::AsyncSaveQueueFullPolicy::Fail:
+                    request->saved.set_value(false);
+                    return saved;
+                default:
+                    throw std::runtime_error("Unknown async save queue full policy: " + std::to_string(static_cast<int>(configuration.asyncSaveQueueFullPolicy)));
+                }
+            }
+
+            asyncSaveQueue.push_back(std::move(request));
+
+            StartAsyncSaveThreadIfNotRunning();
+        }
+
+        asyncSaveQueueNotEmpty.notify_one();
+
+        return saved;
+    }
+
+    void Storage::Impl::StartAsyncSaveThreadIfNotRunning()
+    {
+        // NB: the caller is expected to hold asyncSaveQueueMutex
+        if (!asyncSaveThread.joinable()) {
+            asyncSaveThread = std::thread(&Storage::Impl::AsyncSaveThreadMain, this);
+        }
+    }
+
+    void Storage::Impl::AsyncSaveThreadMain()
+    {
+        while (true) {
+            std::unique_ptr<AsyncSaveRequest> request;
+
+            {
+                std::unique_lock<std::mutex> lock(asyncSaveQueueMutex);
+                asyncSaveQueueNotEmpty.wait(lock, [this]() { return !asyncSaveQueue.empty() || asyncSaveThreadStopRequested; });
+
+                if (asyncSaveQueue.empty()) {
+                    assert(asyncSaveThreadStopRequested);
+                    return; // the queue has been drained, and we're asked to stop
+                }
+
+                request = std::move(asyncSaveQueue.front());
+                asyncSaveQueue.pop_front();
+            }
+
+            asyncSaveQueueNotFull.notify_one();
+
+            try {
+                request->saved.set_value(SaveData(request->dataItem, request->upsert));
+            }
+            catch (...) {
+                request->saved.set_exception(std::current_exception());
+            }
+        }
+    }
+
+    void Storage::Impl::StopAsyncSaveThread()
+    {
+        {
+            std::lock_guard<std::mutex> lock(asyncSaveQueueMutex);
+            asyncSaveThreadStopRequested = true;
+        }
+
+        asyncSaveQueueNotEmpty.notify_all();
+
+        if (asyncSaveThread.joinable()) {
+            asyncSaveThread.join(); // any queued items are saved before the thread exits
+        }
     }
 
     bool Storage::Impl::SaveData(const DataItem* dataItems, size_t dataItemCount, bool upsert)
@@ -50,24 +219,62 @@ namespace isto {
                     return total + (dataItem.isPermanent ? 0 : dataItem.data.size());
                 });
 
+            DeleteRotatingDataExceedingQuotas(dataItems, dataItemCount);
+
             if (!DeleteExcessRotatingData(totalRotatingSizeNeeded)) {
                 return false;
             }
         }
 
+        if (configuration.useSegmentFiles) {
+            return SaveDataToSegmentFiles(dataItems, dataItemCount, upsert);
+        }
+
         bool flushPermanent = false;
         bool flushRotating = false;
 
         std::vector<std::string> directories(dataItemCount), paths(dataItemCount);
         std::unordered_set<std::string> uniqueDirectories;
 
+        std::vector<std::unique_ptr<ItemLocation>> relocatedFrom(dataItemCount); // upserted with a timestamp that maps to another directory
+
+        const bool isPathOfRotatingItemStored = !configuration.rotatingStripes.empty() || !configuration.rotatingTiers.empty();
+
         for (size_t i = 0; i < dataItemCount; ++i) {
             const DataItem& dataItem = dataItems[i];
-            const std::string directory = GetDirectory(dataItem.isPermanent, dataItem.timestamp, configuration.directoryStructureResolution);
+
+            std::unique_ptr<ItemLocation> existingLocation;
+            if (!dataItem.isPermanent && (isPathOfRotatingItemStored || upsert)) {
+                // A new item is looked for only in the partition of its timestamp, so that a save need not query every partition
+                auto* db = upsert ? &GetDatabase(false, dataItem.id) : FindRotatingDatabase(ToMicroseconds(dataItem.timestamp));
+                if (db) {
+                    existingLocation = GetItemLocation(*db, dataItem.id);
+                }
+            }
+
+            if (existingLocation && upsert) {
+                // The item may be in any stripe or tier - keep it there, but in the directory of its new timestamp:
+                // a directory must hold only the items of its own time range, or it could be deleted as a whole (see DeletePayloads)
+                const std::string rootDirectory = configuration.rotatingTiers.empty()
+                    ? GetRotatingVolume(existingLocation->path).directory
+                    : GetTierDirectory(GetTier(existingLocation->path));
+                paths[i] = (fs::path(GetDirectory(rootDirectory, dataItem.timestamp, configuration.directoryStructureResolution)) / dataItem.id).string();
+                if (fs::path(paths[i]) != fs::path(existingLocation->path)) {
+                    relocatedFrom[i] = std::move(existingLocation);
+                }
+            }
+            else if (existingLocation) {
+                // the item may be in any stripe or tier - keep it there (so that it is found to exist already)
+                paths[i] = existingLocation->path;
+            }
+            else {
+                const std::string rootDirectory = dataItem.isPermanent ? GetSubDir(true) : ChooseRotatingRootDirectory();
+                paths[i] = (fs::path(GetDirectory(rootDirectory, dataItem.timestamp, configuration.directoryStructureResolution)) / dataItem.id).string();
+            }
+
+            const std::string directory = fs::path(paths[i]).parent_path().string();
             directories[i] = directory;
             uniqueDirectories.insert(directory);
-
-            paths[i] = GetPath(dataItem.isPermanent, dataItem.timestamp, dataItem.id, configuration.directoryStructureResolution);
         }
 
         std::unordered_set<std::string> createdDirectories;
@@ -95,82 +302,140 @@ namespace isto {
             }
         };
 
-        for (size_t i = 0; i < dataItemCount; ++i) {
-            const bool directoryExistedBefore = createdDirectories.find(directories[i]) == createdDirectories.end();
+        std::vector<std::unique_ptr<std::future<void>>> fileWriteOperations(dataItemCount);
 
-            auto getFileSizeOperation = directoryExistedBefore
-                ? std::async(std::launch::async, getFileSize, i)
-                : std::async(std::launch::deferred, []() { return std::unique_ptr<uintmax_t>(); });
+        const auto writeFile = [&](size_t i, bool replace) {
+            const DataItem& dataItem = dataItems[i];
 
-            getExistingFileSizeOperations[i] = std::make_unique<GetExistingFileSizeOperation>(std::move(getFileSizeOperation));
-        }
+            // An existing file is replaced by renaming a new one over it, so that any views (see GetDataView)
+            // and concurrent readers keep seeing the old contents, instead of a truncated or half-written file
+            const std::string path = replace ? paths[i] + ".upsert" : paths[i];
 
-        std::vector<std::unique_ptr<std::future<void>>> fileWriteOperations(dataItemCount);
+            {
+                std::ofstream out(path, std::ios::binary);
+                out.write(reinterpret_cast<const char*>(dataItem.data.data()), dataItem.data.size());
+            }
 
-        const auto writeFile = [&](size_t i) {
-            const DataItem& dataItem = dataItems[i];
+            if (replace) {
+                fs::rename(path, paths[i]);
+            }
+        };
 
-            std::ofstream out(paths[i], std::ios::binary);
-            out.write(reinterpret_cast<const char*>(dataItem.data.data()), dataItem.data.size());
+        // The file operations refer to local variables, so we must not leave any of them running
+        const auto waitForFileOperations = [&]() {
+            for (auto& getExistingFileSizeOperation : getExistingFileSizeOperations) {
+                if (getExistingFileSizeOperation && getExistingFileSizeOperation->valid()) {
+                    getExistingFileSizeOperation->wait();
+                }
+            }
+            for (auto& fileWriteOperation : fileWriteOperations) {
+                if (fileWriteOperation && fileWriteOperation->valid()) {
+                    fileWriteOperation->wait();
+                }
+            }
         };
 
         std::deque<std::string> filesThatAlreadyExistWhenNotUpserting;
 
-        for (size_t i = 0; i < dataItemCount; ++i) {
+        try {
+            for (size_t i = 0; i < dataItemCount; ++i) {
+                const bool directoryExistedBefore = createdDirectories.find(directories[i]) == createdDirectories.end();
+
+                auto getFileSizeOperation = directoryExistedBefore
+                    ? ioThreadPool.Run([&getFileSize, i]() { return getFileSize(i); })
+                    : std::async(std::launch::deferred, []() { return std::unique_ptr<uintmax_t>(); });
+
+                getExistingFileSizeOperations[i] = std::make_unique<GetExistingFileSizeOperation>(std::move(getFileSizeOperation));
+            }
+
+            for (size_t i = 0; i < dataItemCount; ++i) {
 
-            const auto startFileWriteOperation = [&]() {
-                fileWriteOperations[i] = std::make_unique<std::future<void>>(std::async(std::launch::async, writeFile, i));
-            };
+                const auto startFileWriteOperation = [&](bool replace) {
+                    fileWriteOperations[i] = std::make_unique<std::future<void>>(ioThreadPool.Run([&writeFile, i, replace]() { writeFile(i, replace); }));
+                };
 
-            const auto existingFileSize = getExistingFileSizeOperations[i]->get();
-            if (existingFileSize.get()) {
-                if (upsert) {
-                    // file exists, but we're upserting
-                    currentRotatingDataItemBytes -= *existingFileSize;
-                    startFileWriteOperation();
+                const auto existingFileSize = getExistingFileSizeOperations[i]->get();
+                if (existingFileSize.get()) {
+                    if (upsert) {
+                        // file exists, but we're upserting
+                        currentRotatingDataItemBytes -= *existingFileSize;
+                        quotaAndTierBytesNeedRecount = true;
+                        startFileWriteOperation(true);
+                    }
+                    else {
+                        // file exists and not upserting - this is an error
+                        filesThatAlreadyExistWhenNotUpserting.push_back(paths[i]);
+                    }
                 }
                 else {
-                    // file exists and not upserting - this is an error
-                    filesThatAlreadyExistWhenNotUpserting.push_back(paths[i]);
+                    // the file did not exist before
+                    startFileWriteOperation(false);
                 }
             }
-            else {
-                // the file did not exist before
-                startFileWriteOperation();
-            }
-        }
 
-        for (size_t i = 0; i < dataItemCount; ++i) {
+            for (size_t i = 0; i < dataItemCount; ++i) {
 
-            const bool fileWriteOperationWasActuallyStarted = fileWriteOperations[i].get() != nullptr;
+                const bool fileWriteOperationWasActuallyStarted = fileWriteOperations[i].get() != nullptr;
 
-            if (fileWriteOperationWasActuallyStarted) { // was a file write operation actually started?
-                const DataItem& dataItem = dataItems[i];
+                if (fileWriteOperationWasActuallyStarted) { // was a file write operation actually started?
+                    const DataItem& dataItem = dataItems[i];
 
-                InsertDataItem(dataItem);
+                    ItemLocation location;
+                    location.path = paths[i];
+                    location.size = dataItem.data.size();
 
-                if (dataItem.isPermanent) {
-                    flushPermanent = true;
-                }
-                else {
-                    flushRotating = true;
+                    InsertDataItem(dataItem, location, upsert);
+                    hotItemCache.Put(dataItem);
+
+                    if (dataItem.isPermanent) {
+                        flushPermanent = true;
+                    }
+                    else {
+                        flushRotating = true;
+                    }
+
+                    currentRotatingDataItemBytes += dataItem.data.size();
+
+                    if (!dataItem.isPermanent) {
+                        AddQuotaAndTierBytes(dataItem.tags, GetTier(paths[i]), dataItem.data.size());
+
+                        auto& free = GetRotatingVolume(paths[i]).space.free;
+                        free -= std::min(free, static_cast<uintmax_t>(dataItem.data.size()));
+                    }
                 }
+            }
 
-                currentRotatingDataItemBytes += dataItem.data.size();
+            if (flushPermanent) {
+                FlushIfCommitIntervalReached(true);
             }
-        }
 
-        if (flushPermanent) {
-            FlushPermanent();
+            if (flushRotating) {
+                FlushIfCommitIntervalReached(false);
+            }
+
+            for (auto& fileWriteOperation : fileWriteOperations) {
+                if (fileWriteOperation.get()) {
+                    fileWriteOperation->get(); // wait for the operation to complete
+                }
+            }
+        }
+        catch (...) {
+            waitForFileOperations();
+            throw;
         }
 
-        if (flushRotating) {
+        if (std::any_of(relocatedFrom.begin(), relocatedFrom.end(), [](const std::unique_ptr<ItemLocation>& location) { return location.get() != nullptr; })) {
+            // Remove the previous files only once the metadata that points to the new ones has been committed
             FlushRotating();
-        }
 
-        for (auto& fileWriteOperation : fileWriteOperations) {
-            if (fileWriteOperation.get()) {
-                fileWriteOperation->get(); // wait for the operation to complete
+            for (const auto& previousLocation : relocatedFrom) {
+                if (previousLocation) {
+                    RemoveFileAndEmptyParentDirectories(previousLocation->path);
+
+                    currentRotatingDataItemBytes -= previousLocation->size;
+                    quotaAndTierBytesNeedRecount = true;
+                    GetRotatingVolume(previousLocation->path).space.free += previousLocation->size;
+                }
             }
         }
 
@@ -192,26 +457,157 @@ namespace isto {
         return true;
     }
 
-    void Storage::Impl::InsertDataItem(const DataItem& dataItem)
+    bool Storage::Impl::SaveDataToSegmentFiles(const DataItem* dataItems, size_t dataItemCount, bool upsert)
+    {
+        std::vector<std::unique_ptr<ItemLocation>> locations(dataItemCount);
+        std::vector<std::shared_ptr<SegmentFile>> segmentFiles(dataItemCount);
+
+        std::deque<std::string> itemsThatAlreadyExistWhenNotUpserting;
+
+        for (size_t i = 0; i < dataItemCount; ++i) {
+            const DataItem& dataItem = dataItems[i];
+
+            const auto existingLocation = GetItemLocation(GetDatabase(dataItem.isPermanent, dataItem.id), dataItem.id);
+            if (existingLocation) {
+                if (!upsert) {
+                    itemsThatAlreadyExistWhenNotUpserting.push_back(dataItem.id);
+                    continue;
+                }
+                if (!dataItem.isPermanent) {
+                    // NB: the space is actually reclaimed only when the whole segment is eventually dropped
+                    currentRotatingDataItemBytes -= existingLocation->size;
+                    quotaAndTierBytesNeedRecount = true;
+                }
+            }
+
+            const std::string directory = GetDirectory(dataItem.isPermanent, dataItem.timestamp, configuration.directoryStructureResolution);
+
+            locations[i] = std::make_unique<ItemLocation>(AllocateSegmentSpace(dataItem.isPermanent, directory, dataItem.data.size()));
+            segmentFiles[i] = GetActiveSegment(dataItem.isPermanent).file;
+        }
+
+        // The space has been allocated, so the payloads can be written in parallel
+        std::vector<std::future<void>> writeOperations;
+        writeOperations.reserve(dataItemCount);
+
+        try {
+            for (size_t i = 0; i < dataItemCount; ++i) {
+                if (locations[i]) {
+                    const auto& segmentFile = segmentFiles[i];
+                    const auto offset = locations[i]->segmentOffset;
+                    const DataItem* dataItem = &dataItems[i];
+
+                    writeOperations.push_back(ioThreadPool.Run([segmentFile, offset, dataItem]() {
+                        segmentFile->Write(offset, dataItem->data.data(), dataItem->data.size());
+                    }));
+                }
+            }
+
+            bool flushPermanent = false;
+            bool flushRotating = false;
+
+            for (size_t i = 0; i < dataItemCount; ++i) {
+                if (locations[i]) {
+                    const DataItem& dataItem = dataItems[i];
+
+                    InsertDataItem(dataItem, *locations[i], upsert);
+                    hotItemCache.Put(dataItem);
+
+                    if (dataItem.isPermanent) {
+                        flushPermanent = true;
+                    }
+                    else {
+                        flushRotating = true;
+                        currentRotatingDataItemBytes += dataItem.data.size();
+                        AddQuotaAndTierBytes(dataItem.tags, GetTier(locations[i]->path), dataItem.data.size());
+
+                        auto& free = GetRotatingVolume(locations[i]->path).space.free;
+                        free -= std::min(free, static_cast<uintmax_t>(dataItem.data.size()));
+                    }
+                }
+            }
+
+            if (flushPermanent) {
+                FlushIfCommitIntervalReached(true);
+            }
+
+            if (flushRotating) {
+                FlushIfCommitIntervalReached(false);
+            }
+
+            for (auto& writeOperation : writeOperations) {
+                writeOperation.get();
+            }
+        }
+        catch (...) {
+            // The write operations refer to the data items, so we must not leave any of them running
+            for (auto& writeOperation : writeOperations) {
+                if (writeOperation.valid()) {
+                    writeOperation.wait();
+                }
+            }
+            throw;
+        }
+
+        if (!itemsThatAlreadyExistWhenNotUpserting.empty()) {
+            assert(!upsert);
+            std::string error = "Items that already exist:";
+            for (const auto& id : itemsThatAlreadyExistWhenNotUpserting) {
+                error += "\n" + id;
+            }
+            throw std::runtime_error(error);
+        }
+
+        return true;
+    }
+
+    void Storage::Impl::InsertDataItem(const DataItem& dataItem, const ItemLocation& location, bool upsert)
     {
-        const std::string timestamp = system_clock_time_point_string_conversion::to_string(dataItem.timestamp);
-        const std::string path = GetPath(dataItem.isPermanent, dataItem.timestamp, dataItem.id, configuration.directoryStructureResolution);
+        RotatingPartition* partition = !dataItem.isPermanent && IsRotatingMetadataPartitioned()
+            ? &GetRotatingPartition(ToMicroseconds(dataItem.timestamp))
+            : nullptr;
+
+        auto& db = partition ? partition->db : GetDatabase(dataItem.isPermanent);
+
+        if (partition && upsert) {
+            // An item that is upserted with a different timestamp may move to another partition
+            // - looked up only when upserting, as it may take a query per partition
+            auto& existingDb = GetDatabase(false, dataItem.id);
+            if (existingDb != db) {
+                DeleteMetadata(existingDb, dataItem.id);
+            }
+        }
+
+        if (configuration.useDynamicTags || (partition && partition->isCounted)) {
+            // Replacing the row would neither delete the tags of the previous item (see CreateTablesThatDoNotExist), nor uncount it
+            DeleteMetadata(db, dataItem.id);
+        }
 
-        auto& insert = dataItem.isPermanent ? insertPermanent : insertRotating;
+        auto& insert = partition ? partition->insert : dataItem.isPermanent ? insertPermanent : insertRotating;
 
         int index = 0;
         insert->bind(++index, dataItem.id);
-        insert->bind(++index, timestamp);
-        insert->bind(++index, path);
+        insert->bind(++index, ToMicroseconds(dataItem.timestamp));
+        insert->bind(++index, location.path);
 
 #if SIZE_MAX > 0xffffffff
         // 64-bit system
-        insert->bind(++index, static_cast<int64_t>(dataItem.data.size()));
+        insert->bind(++index, static_cast<int64_t>(location.size));
 #else
         // 32-bit system
-        insert->bind(++index, dataItem.data.size());
+        insert->bind(++index, location.size);
 #endif
 
+        if (location.IsInSegmentFile()) {
+            insert->bind(++index, static_cast<int64_t>(location.segmentOffset));
+        }
+        else {
+            insert->bind(++index); // null
+        }
+
+        // An upserted item stays in its tier (see SaveData), so the tier must be written again too
+        insert->bind(++index, static_cast<long long>(dataItem.isPermanent ? 0 : GetTier(location.path)));
+
         auto tags = dataItem.tags;
 
         for (const std::string& tag : configuration.tags) {
@@ -225,10 +621,49 @@ namespace isto {
         insert->executeStep();
         insert->clearBindings();
         insert->reset();
+
+        if (partition && partition->isCounted) {
+            CountRotatingItem(*partition, location.path, location.size, location.IsInSegmentFile(), false, true);
+        }
+
+        if (configuration.useDynamicTags) {
+            InsertDynamicTags(db, dataItem.id, dataItem.tags);
+        }
+
+        UncommittedChanges& uncommitted = GetUncommittedChanges(dataItem.isPermanent);
+        if (uncommitted.items == 0) {
+            uncommitted.since = std::chrono::steady_clock::now();
+        }
+        ++uncommitted.items;
+        uncommitted.bytes += location.size;
+    }
+
+    std::unique_ptr<Storage::Impl::ItemLocation> Storage::Impl::GetItemLocation(std::unique_ptr<SQLite::Database>& db, const std::string& id)
+    {
+        SQLite::Statement& query = GetStatement(db, "select path, segment_offset, size from DataItems where id = @id");
+        query.bind(1, id);
+
+        if (query.executeStep()) {
+            auto location = std::make_unique<ItemLocation>();
+            location->path = query.getColumn(0).getText();
+            location->segmentOffset = query.getColumn(1).isNull() ? -1 : query.getColumn(1).getInt64();
+            location->size = query.getColumn(2).getInt64();
+            return location;
+        }
+        else {
+            return std::unique_ptr<ItemLocation>();
+        }
     }
 
     DataItem Storage::Impl::GetData(const std::string& id)
     {
+        const auto lock = LockForReading();
+
+        const DataItem cachedDataItem = hotItemCache.Get(id);
+        if (cachedDataItem.isValid) {
+            return cachedDataItem;
+        }
+
         // always try permanent first, because probably we have less permanent data
         DataItem permanentDataItem = GetPermanentData(id);
         if (permanentDataItem.isValid) {
@@ -241,146 +676,216 @@ namespace isto {
         return DataItem::Invalid();
     }
 
-    DataItem FromFuture(std::future<std::unique_ptr<DataItem>>& future)
+    DataItem FromFuture(std::future<std::unique_ptr<DataItem>> future)
     {
-        return DataItem(*future.get().get());
+        return *future.get(); // NB: copying a data item does not copy the payload
     }
 
     DataItem Storage::Impl::GetPermanentData(const std::string& id)
     {
-        return FromFuture(GetData(GetDatabase(true), id, std::launch::deferred));
+        const auto lock = LockForReading();
+        return GetDataUsingCache(true, id);
     }
     
     DataItem Storage::Impl::GetRotatingData(const std::string& id)
     {
-        return FromFuture(GetData(GetDatabase(false), id, std::launch::deferred));
+        const auto lock = LockForReading();
+        return GetDataUsingCache(false, id);
     }
 
-    std::future<std::unique_ptr<DataItem>> Storage::Impl::GetData(std::unique_ptr<SQLite::Database>& db, const std::string& id, std::launch preferredLaunchMode)
+    DataItem Storage::Impl::GetDataUsingCache(bool isPermanent, const std::string& id)
     {
-        std::ostringstream select;
-        select << "select timestamp, path, size";
-            
+        const DataItem cachedDataItem = hotItemCache.Get(id);
+        if (cachedDataItem.isValid && cachedDataItem.isPermanent == isPermanent) {
+            return cachedDataItem;
+        }
+
+        DataItem dataItem = FromFuture(GetData(*ReadConnection(*this, isPermanent, id), id, std::launch::deferred));
+        if (dataItem.isValid) {
+            hotItemCache.Put(dataItem);
+        }
+        return dataItem;
+    }
+
+    DataItem Storage::Impl::GetDataUsingCache(const ItemRecord& record)
+    {
+        const DataItem cachedDataItem = hotItemCache.Get(record.id);
+        if (cachedDataItem.isValid && cachedDataItem.isPermanent == record.isPermanent) {
+            return cachedDataItem;
+        }
+
+        DataItem dataItem = FromFuture(GetData(record, std::launch::deferred));
+        hotItemCache.Put(dataItem);
+        return dataItem;
+    }
+
+    std::string Storage::Impl::GetItemRecordColumns() const
+    {
+        std::string columns = "id, timestamp, path, size, segment_offset, tier";
+
         for (const std::string& tag : configuration.tags) {
-            select << ", " << tag;
+            columns += ", " + tag;
         }
 
-        select << " from DataItems where id = '" + id + "'";
+        return columns;
+    }
 
-        SQLite::Statement query(*db, select.str());
+    Storage::Impl::ItemRecord Storage::Impl::GetItemRecord(const std::unique_ptr<SQLite::Database>& db, SQLite::Statement& query) const
+    {
+        ItemRecord record;
 
-        if (query.executeStep()) {
-            int index = 0;
-            const std::string timestampString = query.getColumn(index++);
-            const std::string path = query.getColumn(index++);
+        int index = 0;
+        record.id = query.getColumn(index++).getText();
+        record.timestamp = FromMicroseconds(query.getColumn(index++).getInt64());
+        record.location.path = query.getColumn(index++).getText();
 
 #if SIZE_MAX > 0xffffffff
-            // 64-bit system
-            const size_t size = query.getColumn(index++).getInt64();
+        // 64-bit system
+        record.location.size = query.getColumn(index++).getInt64();
 #else
-            // 32-bit system
-            const size_t size = query.getColumn(index++);
+        // 32-bit system
+        record.location.size = query.getColumn(index++);
 #endif
 
-            tags_t tags;
-            for (const std::string& tag : configuration.tags) {
-                tags[tag] = query.getColumn(index++).getText();
-            }
-
-            const bool isPermanent = (db == dbPermanent);
+        record.location.segmentOffset = query.getColumn(index).isNull() ? -1 : query.getColumn(index).getInt64();
+        ++index;
 
-            assert(!query.executeStep()); // we don't expect there's another item
-
-            return std::async(std::launch::async, [id, timestampString, path, size, tags, isPermanent]() {
-                std::vector<unsigned char> data(size);
+        record.tier = query.getColumn(index++).getInt();
 
-                if (size > 0) {
-                    std::ifstream in(path, std::ios::binary);
-                    in.read(reinterpret_cast<char*>(&data[0]), size);
-                }
+        for (const std::string& tag : configuration.tags) {
+            record.tags[tag] = query.getColumn(index++).getText();
+        }
 
-                const auto timestamp = system_clock_time_point_string_conversion::from_string(timestampString);
+        record.isPermanent = IsPermanentDatabase(db);
 
-                return std::make_unique<DataItem>(DataItem(id, data, timestamp, isPermanent, tags));
-            });
-        }
-        else {
-            return std::async(std::launch::deferred, []() { return std::make_unique<DataItem>(DataItem::Invalid()); });
-        }
+        return record;
     }
 
-    DataItem Storage::Impl::GetData(const timestamp_t& timestamp, const std::string& comparisonOperator, const tags_t& tags)
+    std::string Storage::Impl::GetTagConditions(const tags_t& tags) const
     {
-        const auto matchedTimestampAndCorrespondingDatabase = FindMatchingTimestampAndCorrespondingDatabase(timestamp, comparisonOperator, tags);
-
-        if (matchedTimestampAndCorrespondingDatabase.first.empty()) {
-            assert(matchedTimestampAndCorrespondingDatabase.second.get() == nullptr);
-            return DataItem::Invalid();
-        }
+        std::string conditions;
 
-        std::string select = "select id from DataItems where timestamp = '" + matchedTimestampAndCorrespondingDatabase.first + "'";
+        int tagIndex = 0;
 
         for (const auto& tag : tags) {
-            select += " and " + tag.first + " = '" + tag.second + "'";
+            if (configuration.useDynamicTags) {
+                const std::string n = std::to_string(tagIndex++);
+                conditions += " and id in (select item from DataItemTags"
+                    " where key = (select id from TagKeys where name = @tag_name_" + n + ")"
+                    " and value = (select id from TagValues where value = @tag_value_" + n + "))";
+            }
+            else {
+                conditions += " and " + tag.first + " = @" + tag.first;
+            }
         }
 
-        SQLite::Statement query(*matchedTimestampAndCorrespondingDatabase.second, select);
+        return conditions;
+    }
 
-        if (query.executeStep()) {
-            const std::string id = query.getColumn(0);
-            return FromFuture(GetData(matchedTimestampAndCorrespondingDatabase.second, id, std::launch::deferred));
-        }
-        else {
-            return DataItem::Invalid();
+    void Storage::Impl::BindTagConditions(SQLite::Statement& query, int& index, const tags_t& tags) const
+    {
+        for (const auto& tag : tags) {
+            if (configuration.useDynamicTags) {
+                query.bind(++index, tag.first);
+            }
+            query.bind(++index, tag.second);
         }
     }
 
-    DataItems Storage::Impl::GetDataItems(const timestamp_t& startTime, const timestamp_t& endTime, const tags_t& tags, size_t maxItems, Order order)
+    void Storage::Impl::ReadDynamicTags(const std::unique_ptr<SQLite::Database>& db, ItemRecord* records, size_t recordCount) const
     {
-        DataItems rotatingDataItems  = GetDataItems(dbRotating,  startTime, endTime, tags, maxItems, order);
-        DataItems permanentDataItems = GetDataItems(dbPermanent, startTime, endTime, tags, maxItems, order);
-
-        if (permanentDataItems.empty()) { return rotatingDataItems;  }
-        if (rotatingDataItems.empty())  { return permanentDataItems; }
+        if (!configuration.useDynamicTags || recordCount == 0) {
+            return;
+        }
 
-        std::vector<const DataItem*> allDataItems;
-        allDataItems.reserve(rotatingDataItems.size() + permanentDataItems.size());
+        // The tags of up to this many items are read using a single query
+        const size_t itemsPerQuery = 100;
 
-        for (const auto& i : rotatingDataItems)  { allDataItems.push_back(&i); }
-        for (const auto& i : permanentDataItems) { allDataItems.push_back(&i); }
+        static const std::string sql = []() {
+            std::string sql = "select DataItemTags.item, TagKeys.name, TagValues.value from DataItemTags"
+                " join TagKeys on TagKeys.id = DataItemTags.key"
+                " join TagValues on TagValues.id = DataItemTags.value"
+                " where DataItemTags.item in (";
+            for (size_t i = 0; i < itemsPerQuery; ++i) {
+                sql += (i > 0 ? ", @item_" : "@item_") + std::to_string(i);
+            }
+            return sql + ")";
+        }();
 
-        const auto timestampCompare = [](const DataItem* lhs, const DataItem* rhs) {
-            return lhs->timestamp < rhs->timestamp;
-        };
+        std::unordered_map<std::string, ItemRecord*> recordsById;
 
-        if (order == Order::Ascending) {
-            std::sort(allDataItems.begin(), allDataItems.end(), timestampCompare);
-        }
-        else if (order == Order::Descending) {
-            std::sort(allDataItems.rbegin(), allDataItems.rend(), timestampCompare);
+        for (size_t i = 0; i < recordCount; ++i) {
+            records[i].tags.clear();
+            recordsById[records[i].id] = &records[i];
         }
 
-        const size_t resultSize = std::min(allDataItems.size(), maxItems);
+        for (size_t begin = 0; begin < recordCount; begin += itemsPerQuery) {
+            SQLite::Statement& query = GetStatement(db, sql);
 
-        DataItems result;
-        result.reserve(resultSize);
+            // the parameters left unbound are null, and match nothing
+            const size_t end = std::min(begin + itemsPerQuery, recordCount);
+            for (size_t i = begin; i < end; ++i) {
+                query.bind(static_cast<int>(i - begin + 1), records[i].id);
+            }
 
-        for (size_t i = 0; i < resultSize; ++i) {
-            result.push_back(std::move(*allDataItems[i]));
+            while (query.executeStep()) {
+                recordsById.at(query.getColumn(0).getText())->tags[query.getColumn(1).getText()] = query.getColumn(2).getText();
+            }
         }
-
-        return result;
     }
 
-    DataItems Storage::Impl::GetDataItems(std::unique_ptr<SQLite::Database>& db, const timestamp_t& startTime, const timestamp_t& endTime, const tags_t& tags, size_t maxItems, Order order)
+    void Storage::Impl::InsertDynamicTags(std::unique_ptr<SQLite::Database>& db, const std::string& item, const tags_t& tags)
     {
-        std::string select = "select id from DataItems where "
-            "timestamp >= '" + system_clock_time_point_string_conversion::to_string(startTime) + "' and "
-            "timestamp <= '" + system_clock_time_point_string_conversion::to_string(endTime) + "'";
+        // Returns the id of the name or value, adding it to the dictionary if needed
+        const auto intern = [&](const std::string& table, const std::string& column, const std::string& text) {
+            SQLite::Statement& insert = GetStatement(db, "insert or ignore into " + table + " (" + column + ") values (@text)");
+            insert.bind(1, text);
+            insert.exec();
+
+            SQLite::Statement& select = GetStatement(db, "select id from " + table + " where " + column + " = @text");
+            select.bind(1, text);
+            if (!select.executeStep()) {
+                throw std::runtime_error("Unable to add to " + table + ": " + text);
+            }
+            return select.getColumn(0).getInt64();
+        };
 
         for (const auto& tag : tags) {
-            select += " and " + tag.first + " = '" + tag.second + "'";
+            const int64_t key = intern("TagKeys", "name", tag.first);
+            const int64_t value = intern("TagValues", "value", tag.second);
+
+            SQLite::Statement& insert = GetStatement(db, "insert into DataItemTags (item, key, value) values (@item, @key, @value)");
+            insert.bind(1, item);
+            insert.bind(2, key);
+            insert.bind(3, value);
+            insert.exec();
+        }
+    }
+
+    std::unique_ptr<Storage::Impl::ItemRecord> Storage::Impl::GetItemRecord(std::unique_ptr<SQLite::Database>& db, const std::string& id)
+    {
+        SQLite::Statement& query = GetStatement(db, "select " + GetItemRecordColumns() + " from DataItems where id = @id");
+        query.bind(1, id);
+
+        if (query.executeStep()) {
+            auto record = std::make_unique<ItemRecord>(GetItemRecord(db, query));
+
+            assert(!query.executeStep()); // we don't expect there's another item
+
+            ReadDynamicTags(db, record.get(), 1);
+
+            return record;
         }
+        else {
+            return std::unique_ptr<ItemRecord>();
+        }
+    }
+
+    std::vector<Storage::Impl::ItemRecord> Storage::Impl::GetItemRecords(std::unique_ptr<SQLite::Database>& db, const timestamp_t& startTime, const timestamp_t& endTime, const tags_t& tags, size_t maxItems, Order order)
+    {
+        std::string select = "select " + GetItemRecordColumns() + " from DataItems where timestamp >= @start_time and timestamp <= @end_time";
+
+        select += GetTagConditions(tags);
 
         if (order == Order::Ascending) {
             select += " order by timestamp asc";
@@ -389,419 +894,2652 @@ namespace isto {
             select += " order by timestamp desc";
         }
 
-        select += " limit " + std::to_string(maxItems);
+        select += " limit @max_items";
+
+        SQLite::Statement& query = GetStatement(db, select);
+
+        int index = 0;
+        query.bind(++index, ToMicroseconds(startTime));
+        query.bind(++index, ToMicroseconds(endTime));
+
+        BindTagConditions(query, index, tags);
+
+        const size_t maxLimit = std::numeric_limits<int64_t>::max();
+        query.bind(++index, static_cast<int64_t>(std::min(maxItems, maxLimit)));
+
+        std::vector<ItemRecord> records;
+
+        while (query.executeStep()) {
+            records.push_back(GetItemRecord(db, query));
+        }
+
+        ReadDynamicTags(db, records.data(), records.size());
+
+        return records;
+    }
+
+    std::vector<Storage::Impl::ItemRecord> Storage::Impl::GetRotatingItemRecords(const timestamp_t& startTime, const timestamp_t& endTime, const tags_t& tags, size_t maxItems, Order order)
+    {
+        if (!IsRotatingMetadataPartitioned()) {
+            return GetItemRecords(*ReadConnection(*this, false), startTime, endTime, tags, maxItems, order);
+        }
+
+        // The partitions do not overlap, so they can be read in order until there are enough items
+        std::vector<ItemRecord> records;
+
+        for (const auto& db : GetRotatingDatabases(ToMicroseconds(startTime), ToMicroseconds(endTime), order == Order::Descending)) {
+            if (records.size() >= maxItems) {
+                break;
+            }
+            for (auto& record : GetItemRecords(*db, startTime, endTime, tags, maxItems - records.size(), order)) {
+                records.push_back(std::move(record));
+            }
+        }
+
+        return records;
+    }
+
+    std::unique_ptr<DataItem> ReadDataItem(const std::string& id, const timestamp_t& timestamp, const std::string& path, size_t size, int64_t segmentOffset, const tags_t& tags, bool isPermanent)
+    {
+        std::vector<unsigned char> data(size);
+
+        if (size > 0) {
+            if (segmentOffset >= 0) {
+                SegmentFile(path, false).Read(segmentOffset, &data[0], size);
+            }
+            else {
+                std::ifstream in(path, std::ios::binary);
+                if (!in.read(reinterpret_cast<char*>(&data[0]), size)) {
+                    return std::make_unique<DataItem>(DataItem::Invalid()); // deleted after the metadata was read
+                }
+            }
+        }
+
+        return std::make_unique<DataItem>(id, std::move(data), timestamp, isPermanent, tags);
+    }
+
+    std::future<std::unique_ptr<DataItem>> Storage::Impl::GetData(std::unique_ptr<SQLite::Database>& db, const std::string& id, std::launch preferredLaunchMode)
+    {
+        const auto record = GetItemRecord(db, id);
+
+        if (record) {
+            return GetData(*record, preferredLaunchMode);
+        }
+        else {
+            return std::async(std::launch::deferred, []() { return std::make_unique<DataItem>(DataItem::Invalid()); });
+        }
+    }
+
+    std::future<std::unique_ptr<DataItem>> Storage::Impl::GetData(const ItemRecord& record, std::launch preferredLaunchMode)
+    {
+        const std::string id = record.id;
+        const timestamp_t timestamp = record.timestamp;
+        const std::string path = record.location.path;
+        const size_t size = static_cast<size_t>(record.location.size);
+        const int64_t segmentOffset = record.location.segmentOffset;
+        const tags_t tags = record.tags;
+        const bool isPermanent = record.isPermanent;
+
+        const auto readFile = [id, timestamp, path, size, segmentOffset, tags, isPermanent]() {
+            return ReadDataItem(id, timestamp, path, size, segmentOffset, tags, isPermanent);
+        };
+
+        if (preferredLaunchMode == std::launch::deferred) {
+            return std::async(std::launch::deferred, readFile); // read on the calling thread
+        }
+        else {
+            return ioThreadPool.Run(readFile);
+        }
+    }
+
+    DataItem Storage::Impl::GetDataView(const std::string& id)
+    {
+        const auto lock = LockForReading();
+
+        // always try permanent first, because probably we have less permanent data
+        for (const bool isPermanent : { true, false }) {
+            const auto record = GetItemRecord(*ReadConnection(*this, isPermanent, id), id);
+            if (record) {
+                const auto timestamp = record->timestamp;
+                const size_t size = static_cast<size_t>(record->location.size);
+
+                if (size == 0) {
+                    return DataItem(id, Payload(), timestamp, record->isPermanent, record->tags); // nothing to map
+                }
+
+                const uintmax_t offset = record->location.IsInSegmentFile() ? record->location.segmentOffset : 0;
+                const auto mappedFile = std::make_shared<MemoryMappedFile>(record->location.path, offset, size);
+                const Payload payload(mappedFile, mappedFile->data(), mappedFile->size());
+
+                return DataItem(id, payload, timestamp, record->isPermanent, record->tags);
+            }
+        }
+
+        return DataItem::Invalid();
+    }
+
+    DataItem Storage::Impl::GetData(const timestamp_t& timestamp, const std::string& comparisonOperator, const tags_t& tags)
+    {
+        const auto lock = LockForReading();
+
+        const int64_t timestampMicroseconds = ToMicroseconds(timestamp);
+
+        std::vector<ItemRecord> candidates = GetRotatingItemRecordsNearestTo(timestampMicroseconds, comparisonOperator, tags);
+
+        for (auto& candidate : GetItemRecordsNearestTo(*ReadConnection(*this, true), timestampMicroseconds, comparisonOperator, tags)) {
+            candidates.push_back(std::move(candidate));
+        }
+
+        if (candidates.empty()) {
+            return DataItem::Invalid();
+        }
+
+        // Pick the nearest candidate; on a tie, prefer the earlier one, and then the permanent one
+        const auto isBetter = [timestampMicroseconds](const ItemRecord& lhs, const ItemRecord& rhs) {
+            const int64_t lhsTimestamp = ToMicroseconds(lhs.timestamp);
+            const int64_t rhsTimestamp = ToMicroseconds(rhs.timestamp);
+            const int64_t lhsDistance = std::abs(lhsTimestamp - timestampMicroseconds);
+            const int64_t rhsDistance = std::abs(rhsTimestamp - timestampMicroseconds);
+            if (lhsDistance != rhsDistance) {
+                return lhsDistance < rhsDistance;
+            }
+            if (lhsTimestamp != rhsTimestamp) {
+                return lhsTimestamp < rhsTimestamp;
+            }
+            return lhs.isPermanent && !rhs.isPermanent;
+        };
+
+        return GetDataUsingCache(*std::min_element(candidates.begin(), candidates.end(), isBetter));
+    }
+
+    std::vector<Storage::Impl::ItemRecord> Storage::Impl::GetItemRecordsNearestTo(std::unique_ptr<SQLite::Database>& db, int64_t timestamp, const std::string& comparisonOperator, const tags_t& tags)
+    {
+        const std::string tagConditions = GetTagConditions(tags);
+
+        const auto select = [&](const std::string& condition, const std::string& order) {
+            return "select " + GetItemRecordColumns() + " from DataItems where timestamp " + condition + " @timestamp" + tagConditions
+                + " order by timestamp " + order + " limit 1";
+        };
+
+        std::string sql;
+
+        if (comparisonOperator == "<" || comparisonOperator == "<=") {
+            sql = select(comparisonOperator, "desc");
+        }
+        else if (comparisonOperator == ">" || comparisonOperator == ">=") {
+            sql = select(comparisonOperator, "asc");
+        }
+        else if (comparisonOperator == "==") {
+            sql = select("=", "asc");
+        }
+        else if (comparisonOperator == "~") {
+            // The best previous and the best next item, using the timestamp index for both
+            sql = "select * from (" + select("<=", "desc") + ") union all select * from (" + select(">=", "asc") + ")";
+        }
+        else {
+            return std::vector<ItemRecord>();
+        }
+
+        SQLite::Statement& query = GetStatement(db, sql);
+
+        // NB: a parameter that appears more than once is bound only once
+        int index = 0;
+        query.bind(++index, timestamp);
+
+        BindTagConditions(query, index, tags);
+
+        std::vector<ItemRecord> records;
+
+        while (query.executeStep()) {
+            records.push_back(GetItemRecord(db, query));
+        }
+
+        ReadDynamicTags(db, records.data(), records.size());
+
+        return records;
+    }
+
+    std::vector<Storage::Impl::ItemRecord> Storage::Impl::GetRotatingItemRecordsNearestTo(int64_t timestamp, const std::string& comparisonOperator, const tags_t& tags)
+    {
+        if (!IsRotatingMetadataPartitioned()) {
+            return GetItemRecordsNearestTo(*ReadConnection(*this, false), timestamp, comparisonOperator, tags);
+        }
+
+        // Look at the partitions nearest to the timestamp first, and stop as soon as something is found
+        const auto findNearest = [&](const std::string& comparisonOperator, bool isBefore) {
+            const auto dbs = isBefore
+                ? GetRotatingDatabases(std::numeric_limits<int64_t>::min(), timestamp, true)
+                : GetRotatingDatabases(timestamp, comparisonOperator == "==" ? timestamp : std::numeric_limits<int64_t>::max());
+
+            for (const auto& db : dbs) {
+                auto records = GetItemRecordsNearestTo(*db, timestamp, comparisonOperator, tags);
+                if (!records.empty()) {
+                    return records;
+                }
+            }
+            return std::vector<ItemRecord>();
+        };
+
+        if (comparisonOperator == "~") {
+            auto records = findNearest("<=", true);
+            for (auto& record : findNearest(">=", false)) {
+                records.push_back(std::move(record));
+            }
+            return records;
+        }
+
+        return findNearest(comparisonOperator, comparisonOperator == "<" || comparisonOperator == "<=");
+    }
+
+    // Merges the items found in the rotating and the permanent databases, each of which is already limited to maxItems
+    template <typename T>
+    std::vector<T> MergeByTimestamp(std::vector<T>&& rotatingItems, std::vector<T>&& permanentItems, size_t maxItems, Order order)
+    {
+        if (permanentItems.empty()) { return std::move(rotatingItems);  }
+        if (rotatingItems.empty())  { return std::move(permanentItems); }
+
+        std::vector<const T*> allItems;
+        allItems.reserve(rotatingItems.size() + permanentItems.size());
+
+        for (const auto& i : rotatingItems)  { allItems.push_back(&i); }
+        for (const auto& i : permanentItems) { allItems.push_back(&i); }
+
+        const auto timestampCompare = [](const T* lhs, const T* rhs) {
+            return lhs->timestamp < rhs->timestamp;
+        };
+
+        if (order == Order::Ascending) {
+            std::sort(allItems.begin(), allItems.end(), timestampCompare);
+        }
+        else if (order == Order::Descending) {
+            std::sort(allItems.rbegin(), allItems.rend(), timestampCompare);
+        }
+
+        const size_t resultSize = std::min(allItems.size(), maxItems);
+
+        std::vector<T> result;
+        result.reserve(resultSize);
+
+        for (size_t i = 0; i < resultSize; ++i) {
+            result.push_back(*allItems[i]); // NB: the payload of a data item is shared, not copied
+        }
+
+        return result;
+    }
+
+    DataItems Storage::Impl::GetDataItems(const timestamp_t& startTime, const timestamp_t& endTime, const tags_t& tags, size_t maxItems, Order order)
+    {
+        const auto lock = LockForReading();
+
+        DataItems rotatingDataItems  = GetDataItems(GetRotatingItemRecords(startTime, endTime, tags, maxItems, order));
+        DataItems permanentDataItems = GetDataItems(GetItemRecords(*ReadConnection(*this, true), startTime, endTime, tags, maxItems, order));
+
+        return MergeByTimestamp(std::move(rotatingDataItems), std::move(permanentDataItems), maxItems, order);
+    }
+
+    DataItems Storage::Impl::GetDataItems(const std::vector<ItemRecord>& records)
+    {
+        std::deque<std::future<std::unique_ptr<DataItem>>> futures;
+
+        for (const auto& record : records) {
+            const auto preferredLaunchMode = futures.empty() ? std::launch::deferred : std::launch::async;
+            futures.emplace_back(GetData(record, preferredLaunchMode));
+        }
+
+        DataItems dataItems;
+        dataItems.reserve(futures.size());
+
+        for (auto& future : futures) {
+            dataItems.emplace_back(FromFuture(std::move(future)));
+        }
+
+        return dataItems;
+    }
+
+    DataItemMetadataItems Storage::Impl::GetMetadataItems(const timestamp_t& startTime, const timestamp_t& endTime, const tags_t& tags, size_t maxItems, Order order)
+    {
+        const auto lock = LockForReading();
+
+        const auto toMetadata = [](const std::vector<ItemRecord>& records) {
+            DataItemMetadataItems metadataItems;
+            metadataItems.reserve(records.size());
+
+            for (const auto& record : records) {
+                DataItemMetadata metadata;
+                metadata.id = record.id;
+                metadata.timestamp = record.timestamp;
+                metadata.isPermanent = record.isPermanent;
+                metadata.size = static_cast<size_t>(record.location.size);
+                metadata.tags = record.tags;
+                metadataItems.push_back(metadata);
+            }
+
+            return metadataItems;
+        };
+
+        DataItemMetadataItems rotatingMetadataItems  = toMetadata(GetRotatingItemRecords(startTime, endTime, tags, maxItems, order));
+        DataItemMetadataItems permanentMetadataItems = toMetadata(GetItemRecords(*ReadConnection(*this, true),  startTime, endTime, tags, maxItems, order));
+
+        return MergeByTimestamp(std::move(rotatingMetadataItems), std::move(permanentMetadataItems), maxItems, order);
+    }
+
+    DataItem Storage::Impl::GetData(const DataItemMetadata& metadata)
+    {
+        const auto lock = LockForReading();
+        return GetDataUsingCache(metadata.isPermanent, metadata.id);
+    }
+
+    std::deque<Storage::Impl::IdAndTimestamp> Storage::Impl::GetIdsAndTimestamps(
+        bool isPermanent,
+        const timestamp_t& startTime,
+        const timestamp_t& endTime,
+        const tags_t& tags,
+        bool descending,
+        const IdAndTimestamp* after,
+        size_t maxItems)
+    {
+        const auto lock = LockForReading();
+
+        std::string select = "select id, timestamp from DataItems where timestamp >= @start_time and timestamp <= @end_time";
+
+        select += GetTagConditions(tags);
+
+        if (after) {
+            // Continue from where the previous page ended (keyset pagination)
+            if (descending) {
+                select += " and timestamp <= @after_timestamp and (timestamp < @after_timestamp or id < @after_id)";
+            }
+            else {
+                select += " and timestamp >= @after_timestamp and (timestamp > @after_timestamp or id > @after_id)";
+            }
+        }
+
+        select += descending
+            ? " order by timestamp desc, id desc limit @max_items"
+            : " order by timestamp asc, id asc limit @max_items";
+
+        std::deque<IdAndTimestamp> result;
+
+        const auto getPage = [&](std::unique_ptr<SQLite::Database>& db, size_t maxItems) {
+            SQLite::Statement& query = GetStatement(db, select);
+
+            int index = 0;
+            query.bind(++index, ToMicroseconds(startTime));
+            query.bind(++index, ToMicroseconds(endTime));
+
+            BindTagConditions(query, index, tags);
+
+            if (after) {
+                query.bind(++index, after->timestamp);
+                query.bind(++index, after->id);
+            }
+
+            const size_t maxLimit = std::numeric_limits<int64_t>::max();
+            query.bind(++index, static_cast<int64_t>(std::min(maxItems, maxLimit)));
+
+            while (query.executeStep()) {
+                IdAndTimestamp item;
+                item.id = query.getColumn(0).getText();
+                item.timestamp = query.getColumn(1).getInt64();
+                result.push_back(item);
+            }
+        };
+
+        if (isPermanent || !IsRotatingMetadataPartitioned()) {
+            getPage(*ReadConnection(*this, isPermanent), maxItems);
+            return result;
+        }
+
+        // The partitions do not overlap, so the page can be continued from one partition to the next
+        const int64_t begin = after && !descending ? after->timestamp : ToMicroseconds(startTime);
+        const int64_t end = after && descending ? after->timestamp : ToMicroseconds(endTime);
+
+        for (const auto& db : GetRotatingDatabases(begin, end, descending)) {
+            if (result.size() >= maxItems) {
+                break;
+            }
+            getPage(*db, maxItems - result.size());
+        }
+
+        return result;
+    }
+
+    std::future<std::unique_ptr<DataItem>> Storage::Impl::GetDataAsync(bool isPermanent, const IdAndTimestamp& item)
+    {
+        const auto lock = LockForReading();
+        return GetData(*ReadConnection(*this, isPermanent, item.timestamp), item.id, std::launch::async);
+    }
+
+    std::string Storage::Impl::GetDirectory(bool isPermanent, const timestamp_t& timestamp, Configuration::DirectoryStructureResolution resolution) const
+    {
+        return GetDirectory(isPermanent ? GetSubDir(true) : GetTierDirectory(0), timestamp, resolution);
+    }
+
+    std::string Storage::Impl::GetDirectory(const std::string& rootDirectory, const timestamp_t& timestamp, Configuration::DirectoryStructureResolution resolution) const
+    {
+        const std::string timestampString = system_clock_time_point_string_conversion::to_string(timestamp);
+
+        const auto getDaysDirectory = [&]() {
+            return fs::path(rootDirectory) / timestampString.substr(0, 10);
+        };
+        const auto getHoursDirectory = [&]() {
+            return getDaysDirectory() / timestampString.substr(11, 2);
+        };
+        const auto getMinutesDirectory = [&]() {
+            return getHoursDirectory() / timestampString.substr(14, 2);
+        };
+
+        switch (resolution) {
+        case Configuration::DirectoryStructureResolution::Minutes: return getMinutesDirectory().string();
+        case Configuration::DirectoryStructureResolution::Hours:   return getHoursDirectory()  .string();
+        case Configuration::DirectoryStructureResolution::Days:    return getDaysDirectory()   .string();
+        default: throw std::runtime_error("Unknown directory structure resolution: " + std::to_string(static_cast<int>(resolution)));
+        }
+    }
+
+    std::string Storage::Impl::GetPath(bool isPermanent, const timestamp_t& timestamp, const std::string& id, Configuration::DirectoryStructureResolution resolution) const
+    {
+        // note that the id doubles as a filename
+        return (fs::path(GetDirectory(isPermanent, timestamp, resolution)) / id).string();
+    }
+
+    bool Storage::Impl::MakePermanent(const std::string& id)
+    {
+        ThrowIfReadOnly();
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        return MoveDataItem(false, true, id);
+    }
+
+    bool Storage::Impl::MakeRotating(const std::string& id)
+    {
+        ThrowIfReadOnly();
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        return MoveDataItem(true, false, id);
+    }
+
+    size_t Storage::Impl::MakePermanent(const std::vector<std::string>& ids)
+    {
+        ThrowIfReadOnly();
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        return MoveDataItems(false, true, ids);
+    }
+
+    bool Storage::Impl::Pin(const std::string& id)
+    {
+        ThrowIfReadOnly();
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+
+        auto& db = GetDatabase(false, id);
+
+        SQLite::Statement& pin = GetStatement(db, "update DataItems set pinned = 1 where id = @id and pinned = 0");
+        pin.bind(1, id);
+
+        if (pin.exec() == 1) {
+            if (RotatingPartition* partition = FindCountedRotatingPartition(db)) {
+                ++partition->pinnedItems;
+            }
+            FlushRotating();
+            return true;
+        }
+
+        // Already pinned, or not found at all
+        SQLite::Statement& query = GetStatement(db, "select 1 from DataItems where id = @id");
+        query.bind(1, id);
+        const bool found = query.executeStep();
+        query.reset();
+        return found;
+    }
+
+    void Storage::Impl::PinReadOnlyFilesIfNeeded()
+    {
+        if (!configuration.makeReadOnlyFilesPermanent) {
+            return;
+        }
+
+        bool pinned = false;
+
+        for (const auto& db : GetRotatingDatabases()) {
+            std::vector<std::string> readOnlyIds;
+
+            {
+                SQLite::Statement query(**db, "select id, path from DataItems where pinned = 0 and segment_offset is null");
+
+                while (query.executeStep()) {
+                    std::error_code error;
+                    const auto permissions = fs::status(query.getColumn(1).getText(), error).permissions();
+                    const auto isWritable = (permissions & fs::perms::owner_write) != fs::perms::none;
+
+                    if (!error && !isWritable) {
+                        readOnlyIds.push_back(query.getColumn(0).getText());
+                    }
+                }
+            }
+
+            RotatingPartition* partition = FindCountedRotatingPartition(*db);
+
+            for (const std::string& id : readOnlyIds) {
+                SQLite::Statement& pin = GetStatement(*db, "update DataItems set pinned = 1 where id = @id");
+                pin.bind(1, id);
+                pin.exec();
+                pinned = true;
+
+                if (partition) {
+                    ++partition->pinnedItems;
+                }
+            }
+        }
+
+        if (pinned) {
+            FlushRotating();
+        }
+    }
+
+    bool Storage::Impl::MoveDataItem(bool sourceIsPermanent, bool destinationIsPermanent, const std::string& id)
+    {
+        return MoveDataItems(sourceIsPermanent, destinationIsPermanent, { id }) == 1;
+    }
+
+    // Links the file to the new name if possible, or copies it if the source and the destination are on different volumes
+    // - the source is left in place, so that it can still be found until the new metadata has been committed
+    void LinkOrCopyFile(const fs::path& source, const fs::path& destination)
+    {
+        fs::create_directories(destination.parent_path());
+
+        std::error_code error;
+        fs::create_hard_link(source, destination, error);
+
+        if (error) {
+            fs::copy_file(source, destination);
+        }
+    }
+
+    size_t Storage::Impl::MoveDataItems(bool sourceIsPermanent, bool destinationIsPermanent, const std::vector<std::string>& ids)
+    {
+        assert(sourceIsPermanent != destinationIsPermanent);
+
+        const auto flush = [this](bool isPermanent) {
+            if (isPermanent) {
+                FlushPermanent();
+            }
+            else {
+                FlushRotating();
+            }
+        };
+
+        const bool isSourceSameAsDestination = configuration.permanentDirectory == configuration.rotatingDirectory;
+
+        const auto updateRotatingDataItemBytes = [&](const ItemRecord& record) {
+            const auto size = record.location.size;
+            if (sourceIsPermanent) {
+                currentRotatingDataItemBytes += size;
+                AddQuotaAndTierBytes(record.tags, record.tier, size);
+            }
+            else {
+                assert(currentRotatingDataItemBytes >= size);
+                currentRotatingDataItemBytes -= size;
+                SubtractQuotaAndTierBytes(record.tags, record.tier, size);
+            }
+        };
+
+        std::vector<ItemRecord> movedItems; // the metadata still to be deleted from the source database
+        std::vector<ItemRecord> copiedItems; // the same, but the payloads were saved anew, so the source payloads go as well
+
+        for (const std::string& id : ids) {
+            const auto record = GetItemRecord(GetDatabase(sourceIsPermanent, id), id);
+            if (!record || GetItemLocation(GetDatabase(destinationIsPermanent, id), id)) {
+                continue;
+            }
+
+            hotItemCache.Erase(id); // the cached item would still have the old isPermanent value
+
+            ItemLocation destinationLocation = record->location;
+
+            if (isSourceSameAsDestination) {
+                // the payload can stay where it is
+            }
+            else if (record->location.IsInSegmentFile()) {
+                // the segment file may be shared, so the payload needs to be copied
+                const DataItem dataItem = FromFuture(GetData(*record, std::launch::deferred));
+                const DataItem newDataItem(dataItem.id, dataItem.data, dataItem.timestamp, destinationIsPermanent, dataItem.tags);
+                if (!dataItem.isValid || !SaveData(&newDataItem, 1, false)) { // not via the public overload, which may close partitions
+                    continue;
+                }
+                copiedItems.push_back(*record);
+                continue;
+            }
+            else {
+                if (!destinationIsPermanent && !DeleteExcessRotatingData(record->location.size)) {
+                    continue;
+                }
+
+                const std::string rootDirectory = destinationIsPermanent ? GetSubDir(true) : ChooseRotatingRootDirectory();
+                destinationLocation.path = (fs::path(GetDirectory(rootDirectory, record->timestamp, configuration.directoryStructureResolution)) / id).string();
+                if (fs::exists(destinationLocation.path)) {
+                    continue;
+                }
+
+                LinkOrCopyFile(record->location.path, destinationLocation.path);
+            }
+
+            const std::string noPayload;
+            InsertDataItem(DataItem(id, noPayload, record->timestamp, destinationIsPermanent, record->tags), destinationLocation, false);
+            movedItems.push_back(*record);
+        }
+
+        if (movedItems.empty() && copiedItems.empty()) {
+            return 0;
+        }
+
+        // Commit the destination first, so that an interrupted move never loses any items
+        // - until the source is committed, an item may be found in both databases, and its payload under both names
+        flush(destinationIsPermanent);
+
+        for (const ItemRecord& record : movedItems) {
+            int deleted = DeleteMetadata(GetDatabase(sourceIsPermanent, record.id), record.id);
+            assert(deleted == 1);
+            updateRotatingDataItemBytes(record);
+        }
+
+        for (const ItemRecord& record : copiedItems) {
+            DeleteItem(sourceIsPermanent, record.id, record.location);
+            if (!sourceIsPermanent) {
+                updateRotatingDataItemBytes(record); // a rotating copy has already been counted when it was saved
+            }
+        }
+
+        flush(sourceIsPermanent);
+
+        if (!isSourceSameAsDestination) {
+            for (const ItemRecord& record : movedItems) {
+                RemoveFileAndEmptyParentDirectories(fs::path(record.location.path)); // the old name only
+            }
+        }
+
+        return movedItems.size() + copiedItems.size();
+    }
+
+    // Removes a file, or a whole directory, and then any parent directories that became empty
+    void RemoveFileAndEmptyParentDirectories(fs::path path)
+    {
+        fs::remove_all(path);
+
+        try {
+            while (path.has_parent_path()) {
+                path = path.parent_path();
+                if (fs::is_empty(path)) {
+                    fs::remove(path);
+                }
+                else {
+                    break;
+                }
+            }
+        }
+        catch (std::exception&) {
+            // the parent directories are left in place
+        }
+    }
+
+    void Storage::Impl::DeleteItem(bool isPermanent, const std::string& id, const ItemLocation& location)
+    {
+        if (location.IsInSegmentFile()) {
+            int deleted = DeleteMetadata(GetDatabase(isPermanent, id), id);
+            assert(deleted == 1);
+
+            // Drop the whole segment file, once none of the items in it remain
+            if (!IsSegmentReferenced(location.path)) {
+                RemoveFileAndEmptyParentDirectories(location.path);
+            }
+            return;
+        }
+
+        const fs::path path = location.path;
+
+        std::future<void> fileDeleteOperation = ioThreadPool.Run([path]() {
+            RemoveFileAndEmptyParentDirectories(path);
+        });
+
+        int deleted = DeleteMetadata(GetDatabase(isPermanent, id), id);
+        assert(deleted == 1);
+
+        fileDeleteOperation.get(); // wait until the file and the empty subdirs (if any) have really been deleted
+    }
+
+    bool Storage::Impl::IsSegmentReferenced(const std::string& path)
+    {
+        const auto isReferenced = [&](std::unique_ptr<SQLite::Database>& db) {
+            SQLite::Statement& query = GetStatement(db, "select 1 from DataItems where path = @path limit 1");
+            query.bind(1, path);
+            return query.executeStep();
+        };
+
+        const auto rotatingDatabases = GetRotatingDatabases();
+
+        return std::any_of(rotatingDatabases.begin(), rotatingDatabases.end(), [&](const RotatingDatabase& db) { return isReferenced(*db); })
+            || isReferenced(dbPermanent)
+            || IsActiveSegment(path);
+    }
+
+    int Storage::Impl::DeleteMetadata(std::unique_ptr<SQLite::Database>& db, const std::string& id)
+    {
+        if (RotatingPartition* partition = FindCountedRotatingPartition(db)) {
+            SQLite::Statement& query = GetStatement(db, "select path, size, segment_offset, pinned from DataItems where id = @id");
+            query.bind(1, id);
+            if (query.executeStep()) {
+                CountRotatingItem(*partition, query.getColumn(0).getText(), query.getColumn(1).getInt64(), !query.getColumn(2).isNull(), query.getColumn(3).getInt() != 0, false);
+            }
+            query.reset();
+        }
+
+        SQLite::Statement& statement = GetStatement(db, "delete from DataItems where id = @id");
+        statement.bind(1, id);
+        return statement.exec();
+    }
+
+    Storage::Impl::ActiveSegment& Storage::Impl::GetActiveSegment(bool isPermanent)
+    {
+        return isPermanent ? activePermanentSegment : activeRotatingSegment;
+    }
+
+    std::string Storage::Impl::GetSegmentPath(bool isPermanent, const std::string& directory, unsigned int index) const
+    {
+        // the rotating and the permanent directories may be the same
+        const std::string prefix = isPermanent ? "isto_permanent_segment_" : "isto_rotating_segment_";
+        return (fs::path(directory) / (prefix + std::to_string(index))).string();
+    }
+
+    Storage::Impl::ItemLocation Storage::Impl::AllocateSegmentSpace(bool isPermanent, const std::string& directory, uintmax_t size)
+    {
+        ActiveSegment& segment = GetActiveSegment(isPermanent);
+
+        if (!segment.file || segment.directory != directory) {
+            RetireSegment(segment);
+            OpenActiveSegment(isPermanent, directory, 0);
+        }
+
+        const auto maxSegmentSize = static_cast<uintmax_t>(configuration.segmentFileSizeInMiB * 1024 * 1024);
+
+        if (segment.size > 0 && segment.size + size > maxSegmentSize) {
+            const unsigned int nextIndex = segment.index + 1;
+            RetireSegment(segment);
+            OpenActiveSegment(isPermanent, directory, nextIndex);
+        }
+
+        ItemLocation location;
+        location.path = segment.file->GetPath();
+        location.segmentOffset = segment.size;
+        location.size = size;
+
+        segment.size += size;
+
+        return location;
+    }
+
+    void Storage::Impl::OpenActiveSegment(bool isPermanent, const std::string& directory, unsigned int minIndex)
+    {
+        fs::create_directories(directory);
+
+        // Continue the latest existing segment, if any (for example, after a restart)
+        const std::string prefix = fs::path(GetSegmentPath(isPermanent, directory, 0)).filename().string();
+        const std::string prefixWithoutIndex = prefix.substr(0, prefix.length() - 1);
+
+        unsigned int index = minIndex;
+
+        for (const auto& entry : fs::directory_iterator(directory)) {
+            const std::string filename = entry.path().filename().string();
+            if (filename.compare(0, prefixWithoutIndex.length(), prefixWithoutIndex) == 0) {
+                try {
+                    index = std::max(index, static_cast<unsigned int>(std::stoul(filename.substr(prefixWithoutIndex.length()))));
+                }
+                catch (std::exception&) {
+                    // not a segment file after all
+                }
+            }
+        }
+
+        const std::string path = GetSegmentPath(isPermanent, directory, index);
+
+        ActiveSegment& segment = GetActiveSegment(isPermanent);
+        segment.directory = directory;
+        segment.index = index;
+        segment.size = fs::exists(path) ? fs::file_size(path) : 0;
+        segment.file = std::make_shared<SegmentFile>(path, true);
+        segment.file->Preallocate(static_cast<uintmax_t>(configuration.segmentFileSizeInMiB * 1024 * 1024));
+    }
+
+    void Storage::Impl::RetireSegment(ActiveSegment& segment)
+    {
+        if (segment.file) {
+            // Release the preallocated space that was not used
+            // - any writes still in progress are within the used size, and keep the file open until they complete
+            segment.file->Truncate(segment.size);
+        }
+        segment = ActiveSegment();
+    }
+
+    bool Storage::Impl::IsActiveSegment(const std::string& path)
+    {
+        const auto isActive = [&path](const ActiveSegment& segment) {
+            return segment.file && segment.file->GetPath() == path;
+        };
+        return isActive(activeRotatingSegment) || isActive(activePermanentSegment);
+    }
+
+    void Storage::Impl::FlushRotating()
+    {
+        Flush(GetDatabase(false));
+
+        // Commit only the partitions that have changed, as they would otherwise all be committed after each item
+        for (auto& i : rotatingPartitions) {
+            RotatingPartition& partition = i.second;
+            if (!partition.db) {
+                continue; // committed when closed
+            }
+            const int totalChanges = partition.db->getTotalChanges();
+            if (totalChanges != partition.committedChanges) {
+                Flush(partition.db);
+                partition.committedChanges = totalChanges;
+            }
+        }
+    }
+
+    void Storage::Impl::FlushPermanent()
+    {
+        Flush(GetDatabase(true));
+    }
+
+    void Storage::Impl::Flush(std::unique_ptr<SQLite::Database>& db)
+    {
+        db->exec("commit");
+        db->exec("begin exclusive");
+
+        GetUncommittedChanges(db == dbPermanent) = UncommittedChanges();
+    }
+
+    void Storage::Impl::Flush()
+    {
+        if (configuration.readOnly) {
+            return; // nothing to commit
+        }
+
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+
+        FlushPermanent();
+        FlushRotating();
+    }
+
+    Storage::Impl::UncommittedChanges& Storage::Impl::GetUncommittedChanges(bool isPermanent)
+    {
+        return isPermanent ? uncommittedPermanent : uncommittedRotating;
+    }
+
+    void Storage::Impl::FlushIfCommitIntervalReached(bool isPermanent)
+    {
+        const UncommittedChanges& uncommitted = GetUncommittedChanges(isPermanent);
+
+        if (uncommitted.items == 0) {
+            return;
+        }
+
+        const bool itemLimitReached = configuration.commitIntervalItems > 0
+            && uncommitted.items >= configuration.commitIntervalItems;
+
+        const bool byteLimitReached = configuration.commitIntervalBytes > 0
+            && uncommitted.bytes >= configuration.commitIntervalBytes;
+
+        const bool timeLimitReached = configuration.commitIntervalMilliseconds > 0
+            && std::chrono::steady_clock::now() - uncommitted.since >= std::chrono::milliseconds(configuration.commitIntervalMilliseconds);
+
+        if (itemLimitReached || byteLimitReached || timeLimitReached) {
+            if (isPermanent) {
+                FlushPermanent();
+            }
+            else {
+                FlushRotating();
+            }
+        }
+    }
+
+    void Storage::Impl::StartCommitThreadIfNeeded()
+    {
+        if (configuration.commitIntervalMilliseconds > 0) {
+            commitThread = std::thread(&Storage::Impl::CommitThreadMain, this);
+        }
+    }
+
+    void Storage::Impl::CommitThreadMain()
+    {
+        // Check a few times per interval, so that no metadata stays uncommitted for much longer than the interval
+        const auto checkInterval = std::chrono::milliseconds(configuration.commitIntervalMilliseconds) / 4 + std::chrono::milliseconds(1);
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(commitThreadMutex);
+                if (commitThreadCondition.wait_for(lock, checkInterval, [this]() { return commitThreadStopRequested; })) {
+                    return;
+                }
+            }
+
+            std::lock_guard<std::recursive_mutex> lock(mutex);
+            FlushIfCommitIntervalReached(true);
+            FlushIfCommitIntervalReached(false);
+            CloseIdleRotatingPartitions(configuration.idleRotatingPartitionCloseSeconds);
+        }
+    }
+
+    void Storage::Impl::StopCommitThread()
+    {
+        {
+            std::lock_guard<std::mutex> lock(commitThreadMutex);
+            commitThreadStopRequested = true;
+        }
+
+        commitThreadCondition.notify_all();
+
+        if (commitThread.joinable()) {
+            commitThread.join();
+        }
+    }
+
+    SQLite::Statement& Storage::Impl::GetStatement(const std::unique_ptr<SQLite::Database>& db, const std::string& sql) const
+    {
+        std::lock_guard<std::mutex> lock(statementsMutex);
+
+        auto& dbStatements = statements[db.get()];
+        auto i = dbStatements.find(sql);
+
+        if (i == dbStatements.end()) {
+            // NB: not cached until prepared, so that a statement that fails to prepare (e.g., no such table yet) is tried again
+            auto statement = std::make_unique<SQLite::Statement>(*db, sql);
+            i = dbStatements.emplace(sql, std::move(statement)).first;
+        }
+        else {
+            i->second->reset();
+            i->second->clearBindings();
+        }
+
+        return *i->second;
+    }
+
+    void Storage::Impl::ResetStatements(const std::unique_ptr<SQLite::Database>& db) const
+    {
+        std::lock_guard<std::mutex> lock(statementsMutex);
+
+        for (auto& statement : statements[db.get()]) {
+            statement.second->reset();
+        }
+    }
+
+    std::unique_ptr<SQLite::Database>& Storage::Impl::GetDatabase(bool isPermanent)
+    {
+        return isPermanent ? dbPermanent : dbRotating;
+    }
+
+    std::unique_ptr<SQLite::Database>& Storage::Impl::GetDatabase(bool isPermanent, const std::string& id)
+    {
+        if (isPermanent || !IsRotatingMetadataPartitioned()) {
+            return GetDatabase(isPermanent);
+        }
+
+        // The newest items are probably looked up the most - and the older partitions need not even be opened then
+        for (auto i = rotatingPartitions.rbegin(); i != rotatingPartitions.rend(); ++i) {
+            auto& db = GetRotatingPartitionDatabase(i->second);
+            SQLite::Statement& query = GetStatement(db, "select 1 from DataItems where id = @id");
+            query.bind(1, id);
+            if (query.executeStep()) {
+                return db;
+            }
+        }
+
+        return dbRotating; // which has no items (see MoveUnpartitionedRotatingItems), so the item is not found there either
+    }
+
+    std::unique_ptr<SQLite::Database>& Storage::Impl::GetDatabase(bool isPermanent, int64_t timestamp)
+    {
+        if (isPermanent || !IsRotatingMetadataPartitioned()) {
+            return GetDatabase(isPermanent);
+        }
+
+        auto* db = FindRotatingDatabase(timestamp);
+        return db ? *db : dbRotating; // the partition may have been dropped already, and then the item is not found either
+    }
+
+    bool Storage::Impl::IsRotatingMetadataPartitioned() const
+    {
+        return configuration.rotatingMetadataPartitioning != Configuration::RotatingMetadataPartitioning::None;
+    }
+
+    std::vector<std::unique_ptr<SQLite::Database>*> Storage::Impl::GetAllDatabases()
+    {
+        std::vector<std::unique_ptr<SQLite::Database>*> dbs = { &dbRotating, &dbPermanent };
+
+        for (auto& i : rotatingPartitions) {
+            if (i.second.db) { // the others are upgraded when opened (see GetRotatingPartitionDatabase)
+                dbs.push_back(&i.second.db);
+            }
+        }
+
+        return dbs;
+    }
+
+    std::unique_ptr<SQLite::Database>& Storage::Impl::RotatingDatabase::operator*() const
+    {
+        return partition ? impl->GetRotatingPartitionDatabase(*partition) : impl->dbRotating;
+    }
+
+    std::vector<Storage::Impl::RotatingDatabase> Storage::Impl::GetRotatingDatabases(int64_t begin, int64_t end, bool descending)
+    {
+        if (!IsRotatingMetadataPartitioned()) {
+            return { RotatingDatabase(*this, nullptr) };
+        }
+
+        std::vector<RotatingDatabase> dbs;
+
+        for (auto& i : rotatingPartitions) {
+            if (i.second.begin <= end && i.second.end > begin) {
+                dbs.emplace_back(*this, &i.second);
+            }
+        }
+
+        if (descending) {
+            std::reverse(dbs.begin(), dbs.end());
+        }
+
+        return dbs;
+    }
+
+    std::unique_ptr<SQLite::Database>* Storage::Impl::FindRotatingDatabase(int64_t timestamp)
+    {
+        if (!IsRotatingMetadataPartitioned()) {
+            return &dbRotating;
+        }
+
+        RotatingPartition* partition = FindRotatingPartition(timestamp);
+        return partition ? &GetRotatingPartitionDatabase(*partition) : nullptr;
+    }
+
+    Storage::Impl::RotatingPartition* Storage::Impl::FindRotatingPartition(int64_t timestamp)
+    {
+        auto i = rotatingPartitions.upper_bound(timestamp);
+        if (i == rotatingPartitions.begin()) {
+            return nullptr;
+        }
+
+        --i;
+        return timestamp < i->second.end ? &i->second : nullptr;
+    }
+
+    namespace {
+        const int64_t microsecondsPerHour = int64_t(3600) * 1000 * 1000;
+        const int64_t microsecondsPerDay = 24 * microsecondsPerHour;
+
+        int64_t FloorToMultiple(int64_t value, int64_t multiple)
+        {
+            const int64_t remainder = value % multiple;
+            return value - (remainder < 0 ? remainder + multiple : remainder);
+        }
+
+        // The number of days since 1970-01-01 of a date in the proleptic Gregorian calendar
+        int64_t DaysFromCivil(int64_t year, unsigned int month, unsigned int day)
+        {
+            year -= month <= 2;
+            const int64_t era = (year >= 0 ? year : year - 399) / 400;
+            const unsigned int yearOfEra = static_cast<unsigned int>(year - era * 400);
+            const unsigned int dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+            const unsigned int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+            return era * 146097 + static_cast<int64_t>(dayOfEra) - 719468;
+        }
+    }
+
+    Storage::Impl::RotatingPartition& Storage::Impl::GetRotatingPartition(int64_t timestamp)
+    {
+        RotatingPartition* existing = FindRotatingPartition(timestamp);
+        if (existing) {
+            GetRotatingPartitionDatabase(*existing);
+            return *existing;
+        }
+
+        bool isHourly = configuration.rotatingMetadataPartitioning == Configuration::RotatingMetadataPartitioning::Hours;
+
+        const auto getRange = [&]() {
+            const int64_t length = isHourly ? microsecondsPerHour : microsecondsPerDay;
+            const int64_t begin = FloorToMultiple(timestamp, length);
+            return std::make_pair(begin, begin + length);
+        };
+
+        auto range = getRange();
+
+        // If the partitioning has been changed from hours to days, a day may already be partly covered by hourly partitions
+        const bool isPartlyCovered = std::any_of(rotatingPartitions.begin(), rotatingPartitions.end(), [&range](const std::pair<const int64_t, RotatingPartition>& i) {
+            return i.second.begin < range.second && i.second.end > range.first;
+        });
+        if (isPartlyCovered) {
+            isHourly = true;
+            range = getRange();
+        }
+
+        AddRotatingPartition(GetRotatingPartitionPath(range.first, isHourly), range.first, range.second);
+
+        RotatingPartition& partition = rotatingPartitions.at(range.first);
+        GetRotatingPartitionDatabase(partition);
+        return partition;
+    }
+
+    std::string Storage::Impl::GetRotatingPartitionPath(int64_t begin, bool isHourly) const
+    {
+        const std::string timestampString = system_clock_time_point_string_conversion::to_string(FromMicroseconds(begin));
+
+        std::string name = "isto_rotating_" + timestampString.substr(0, 10);
+        if (isHourly) {
+            name += "_" + timestampString.substr(11, 2);
+        }
+
+        return (fs::path(GetSubDir(false)) / (name + ".sqlite")).string();
+    }
+
+    void Storage::Impl::AddRotatingPartition(const std::string& path, int64_t begin, int64_t end)
+    {
+        RotatingPartition& partition = rotatingPartitions[begin];
+        partition.begin = begin;
+        partition.end = end;
+        partition.path = path;
+    }
+
+    namespace {
+        const int readOnlyBusyTimeoutMilliseconds = 10000; // the writer may hold the lock briefly while committing, as with the connection pool
+    }
+
+    std::unique_ptr<SQLite::Database>& Storage::Impl::GetRotatingPartitionDatabase(RotatingPartition& partition)
+    {
+        partition.lastUsed = std::chrono::steady_clock::now();
+
+        if (!partition.db && configuration.readOnly) {
+            // Nothing is created or upgraded, and no transaction is held (see OpenDatabasesReadOnly)
+            partition.db = std::unique_ptr<SQLite::Database>(new SQLite::Database(partition.path, SQLITE_OPEN_READONLY, readOnlyBusyTimeoutMilliseconds));
+        }
+        else if (!partition.db) {
+            partition.db = std::unique_ptr<SQLite::Database>(new SQLite::Database(partition.path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE));
+            partition.db->exec("pragma journal_mode = wal"); // see CreateDatabases
+
+            // A new partition gets its schema here, and an existing one is upgraded if needed (see the constructor)
+            // - outside the transaction, so that the schema is not lost, should the first commit be interrupted
+            CreateTablesThatDoNotExist({ &partition.db });
+            AddColumnsThatDoNotExist({ &partition.db });
+            CreateIndexesThatDoNotExist({ &partition.db });
+
+            partition.db->exec("begin exclusive");
+            partition.committedChanges = partition.db->getTotalChanges();
+            partition.insert = std::unique_ptr<SQLite::Statement>(new SQLite::Statement(*partition.db, GetInsertStatement()));
+        }
+
+        return partition.db;
+    }
+
+    void Storage::Impl::CloseRotatingPartition(RotatingPartition& partition, bool commit)
+    {
+        if (!partition.db) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(statementsMutex);
+            statements.erase(partition.db.get());
+        }
+
+        partition.insert.reset();
+
+        if (commit && partition.db->getTotalChanges() != partition.committedChanges) {
+            partition.db->exec("commit");
+        }
+
+        partition.db.reset(); // rolls back the transaction, if still open, and closes the file
+    }
+
+    void Storage::Impl::CloseIdleRotatingPartitions(double maxIdleSeconds)
+    {
+        if (rotatingPartitions.empty()) {
+            return;
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        const RotatingPartition* newest = &rotatingPartitions.rbegin()->second;
+
+        for (auto& i : rotatingPartitions) {
+            RotatingPartition& partition = i.second;
+            if (partition.db && &partition != newest && now - partition.lastUsed >= std::chrono::duration<double>(maxIdleSeconds)) {
+                CloseRotatingPartition(partition, true);
+            }
+        }
+    }
+
+    void Storage::Impl::RefreshReadOnlyRotatingPartitions()
+    {
+        if (!IsRotatingMetadataPartitioned()) {
+            return;
+        }
+
+        // A statement that was not stepped to the end would keep the partition reading an old snapshot (see ReadConnection)
+        for (auto& i : rotatingPartitions) {
+            if (i.second.db) {
+                ResetStatements(i.second.db);
+            }
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (now - rotatingPartitionsScannedAt < std::chrono::seconds(1)) {
+            return;
+        }
+        rotatingPartitionsScannedAt = now;
+
+        // The writer drops the oldest partitions by removing their files
+        for (auto i = rotatingPartitions.begin(); i != rotatingPartitions.end();) {
+            std::error_code error;
+            if (!fs::exists(i->second.path, error)) {
+                CloseRotatingPartition(i->second, false);
+                i = rotatingPartitions.erase(i);
+            }
+            else {
+                ++i;
+            }
+        }
+
+        AddExistingRotatingPartitions();
+
+        // Not to keep the writer from removing the files of the partitions that it drops
+        CloseIdleRotatingPartitions(configuration.idleRotatingPartitionCloseSeconds);
+    }
+
+    void Storage::Impl::AddExistingRotatingPartitions()
+    {
+        if (IsRotatingMetadataPartitioned() && configuration.readConnectionCount > 0) {
+            throw std::runtime_error("Rotating metadata partitioning cannot be combined with read connections");
+        }
+
+        // Any existing partitions are found even if the partitioning has since been disabled, so that the error below is thrown
+        const std::string prefix = "isto_rotating_", suffix = ".sqlite";
+
+        for (const auto& entry : fs::directory_iterator(GetSubDir(false))) {
+            const std::string name = entry.path().filename().string();
+
+            if (name.size() <= prefix.size() + suffix.size()
+                || name.compare(0, prefix.size(), prefix) != 0
+                || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+                continue;
+            }
+
+            const std::string date = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size()); // YYYY-MM-DD or YYYY-MM-DD_HH
+
+            int year = 0, hour = 0;
+            unsigned int month = 0, day = 0;
+            char separator = 0;
+
+            const int fieldCount = std::sscanf(date.c_str(), "%4d-%2u-%2u%c%2d", &year, &month, &day, &separator, &hour);
+            const bool isHourly = fieldCount == 5 && separator == '_' && date.size() == 13;
+
+            if (!isHourly && !(fieldCount == 3 && date.size() == 10)) {
+                continue;
+            }
+
+            const int64_t begin = DaysFromCivil(year, month, day) * microsecondsPerDay + hour * microsecondsPerHour;
+            AddRotatingPartition(entry.path().string(), begin, begin + (isHourly ? microsecondsPerHour : microsecondsPerDay));
+        }
+
+        if (!rotatingPartitions.empty() && !IsRotatingMetadataPartitioned()) {
+            throw std::runtime_error("Rotating metadata partitions exist, but the partitioning is disabled");
+        }
+    }
+
+    void Storage::Impl::CountRotatingPartition(RotatingPartition& partition)
+    {
+        if (partition.isCounted) {
+            return;
+        }
+
+        auto& db = GetRotatingPartitionDatabase(partition);
+
+        SQLite::Statement query(*db, "select path, size, segment_offset, pinned from DataItems");
+        while (query.executeStep()) {
+            CountRotatingItem(partition, query.getColumn(0).getText(), query.getColumn(1).getInt64(), !query.getColumn(2).isNull(), query.getColumn(3).getInt() != 0, true);
+        }
+
+        partition.isCounted = true;
+    }
+
+    Storage::Impl::RotatingPartition* Storage::Impl::FindCountedRotatingPartition(const std::unique_ptr<SQLite::Database>& db)
+    {
+        for (auto& i : rotatingPartitions) {
+            if (i.second.isCounted && i.second.db && i.second.db.get() == db.get()) {
+                return &i.second;
+            }
+        }
+        return nullptr;
+    }
+
+    void Storage::Impl::CountRotatingItem(RotatingPartition& partition, const std::string& path, uintmax_t size, bool isInSegmentFile, bool isPinned, bool add)
+    {
+        const auto count = [add](auto& total, uintmax_t amount) {
+            total = add ? total + amount : total - std::min<uintmax_t>(total, amount);
+        };
+
+        count(partition.bytes, size);
+
+        if (!isInSegmentFile) { // the payloads in a segment file free no space yet (see GetFreedDiskSpace)
+            count(partition.fileBytes[&GetRotatingVolume(path)], size);
+        }
+        if (isPinned) {
+            count(partition.pinnedItems, 1);
+        }
+    }
+
+    void Storage::Impl::MoveUnpartitionedRotatingItems()
+    {
+        if (!IsRotatingMetadataPartitioned()) {
+            return;
+        }
+
+        std::vector<ItemRecord> records;
+        std::vector<bool> pinned;
+
+        {
+            SQLite::Statement query(*dbRotating, "select " + GetItemRecordColumns() + ", pinned from DataItems");
+            while (query.executeStep()) {
+                records.push_back(GetItemRecord(dbRotating, query));
+                pinned.push_back(query.getColumn(query.getColumnCount() - 1).getInt() != 0);
+            }
+        }
+
+        if (records.empty()) {
+            return;
+        }
+
+        ReadDynamicTags(dbRotating, records.data(), records.size());
+
+        for (size_t i = 0, end = records.size(); i < end; ++i) {
+            const ItemRecord& record = records[i];
+
+            InsertDataItem(DataItem(record.id, std::vector<unsigned char>(), record.timestamp, false, record.tags), record.location, false);
+
+            auto& db = *FindRotatingDatabase(ToMicroseconds(record.timestamp));
+            SQLite::Statement& update = GetStatement(db, "update DataItems set pinned = @pinned, tier = @tier where id = @id");
+            update.bind(1, pinned[i] ? 1 : 0);
+            update.bind(2, record.tier);
+            update.bind(3, record.id);
+            update.exec();
+
+            RotatingPartition* partition = FindCountedRotatingPartition(db);
+            if (partition && pinned[i]) {
+                ++partition->pinnedItems;
+            }
+        }
+
+        // Commit the partitions first, so that an interrupted move never loses any items
+        FlushRotating();
+
+        dbRotating->exec("delete from DataItems");
+        FlushRotating();
+    }
+
+    void Storage::Impl::DropRotatingPartition(int64_t begin)
+    {
+        auto i = rotatingPartitions.find(begin);
+        if (i == rotatingPartitions.end()) {
+            return;
+        }
+
+        RotatingPartition& partition = i->second;
+        const std::string path = partition.path;
+
+        CloseRotatingPartition(partition, false);
+
+        rotatingPartitions.erase(i);
+
+        for (const char* extension : { "", "-journal", "-wal", "-shm" }) {
+            std::error_code error;
+            fs::remove(path + extension, error);
+        }
+    }
+
+    bool Storage::Impl::IsPermanentDatabase(const std::unique_ptr<SQLite::Database>& db) const
+    {
+        return db == dbPermanent || (permanentConnectionPool && permanentConnectionPool->Owns(db));
+    }
+
+    Storage::Impl::ReadConnection::ReadConnection(Impl& impl, bool isPermanent)
+        : impl(impl)
+        , pool(isPermanent ? impl.permanentConnectionPool.get() : impl.rotatingConnectionPool.get())
+        , db(pool ? pool->Acquire() : impl.GetDatabase(isPermanent))
+    {}
+
+    Storage::Impl::ReadConnection::ReadConnection(Impl& impl, bool isPermanent, const std::string& id)
+        : impl(impl)
+        , pool(isPermanent ? impl.permanentConnectionPool.get() : impl.rotatingConnectionPool.get())
+        , db(pool ? pool->Acquire() : impl.GetDatabase(isPermanent, id))
+    {}
+
+    Storage::Impl::ReadConnection::ReadConnection(Impl& impl, bool isPermanent, int64_t timestamp)
+        : impl(impl)
+        , pool(isPermanent ? impl.permanentConnectionPool.get() : impl.rotatingConnectionPool.get())
+        , db(pool ? pool->Acquire() : impl.GetDatabase(isPermanent, timestamp))
+    {}
+
+    Storage::Impl::ReadConnection::~ReadConnection()
+    {
+        if (pool || impl.configuration.readOnly) {
+            // A statement that was not stepped to the end would keep the connection reading an old snapshot
+            impl.ResetStatements(db);
+        }
+        if (pool) {
+            pool->Release(db);
+        }
+    }
+
+    std::unique_lock<std::recursive_mutex> Storage::Impl::LockForReading()
+    {
+        if (rotatingConnectionPool) {
+            return std::unique_lock<std::recursive_mutex>(mutex, std::defer_lock);
+        }
+
+        std::unique_lock<std::recursive_mutex> lock(mutex);
+
+        if (configuration.readOnly) {
+            RefreshReadOnlyRotatingPartitions();
+        }
+
+        return lock;
+    }
+
+    std::string Storage::Impl::GetSubDir(bool isPermanent) const
+    {
+        return fs::path(isPermanent ? configuration.permanentDirectory : configuration.rotatingDirectory).string();
+    }
+
+    std::string Storage::Impl::GetTierDirectory(size_t tier) const
+    {
+        return configuration.rotatingTiers.empty() ? GetSubDir(false) : fs::path(configuration.rotatingTiers[tier].directory).string();
+    }
+
+    unsigned int Storage::Impl::GetTier(const std::string& path) const
+    {
+        for (size_t tier = 1, end = configuration.rotatingTiers.size(); tier < end; ++tier) {
+            const auto relativePath = fs::path(path).lexically_relative(GetTierDirectory(tier));
+            if (!relativePath.empty() && *relativePath.begin() != "..") {
+                return static_cast<unsigned int>(tier);
+            }
+        }
+
+        return 0;
+    }
+
+    void Storage::Impl::CreateDirectoriesThatDoNotExist()
+    {
+        fs::create_directories(GetSubDir(false));
+        fs::create_directories(GetSubDir(true));
+
+        if (!configuration.rotatingTiers.empty() && configuration.useSegmentFiles) {
+            throw std::runtime_error("The rotating tiers cannot be used together with segment files");
+        }
+
+        for (const auto& tier : configuration.rotatingTiers) {
+            fs::create_directories(tier.directory);
+        }
+    }
+
+    void Storage::Impl::CreateDatabases()
+    {
+        dbRotating = std::unique_ptr<SQLite::Database>(new SQLite::Database((fs::path(GetSubDir(false)) / "isto_rotating.sqlite").string(), SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE));
+        dbPermanent = std::unique_ptr<SQLite::Database>(new SQLite::Database((fs::path(GetSubDir(true)) / "isto_permanent.sqlite").string(), SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE));
+
+        if (configuration.readConnectionCount > 0 || IsRotatingMetadataPartitioned()) {
+            // NB: in WAL mode, the exclusive transaction of the writer does not block the readers (see Configuration::readOnly)
+            dbRotating->exec("pragma journal_mode = wal");
+            dbPermanent->exec("pragma journal_mode = wal");
+        }
+
+        dbRotating->exec("begin exclusive");
+        dbPermanent->exec("begin exclusive");
+
+        AddExistingRotatingPartitions();
+    }
+
+    void Storage::Impl::OpenDatabasesReadOnly()
+    {
+        // NB: no transaction is held, so that each read sees the latest metadata committed by the writer
+        dbRotating = std::unique_ptr<SQLite::Database>(new SQLite::Database((fs::path(GetSubDir(false)) / "isto_rotating.sqlite").string(), SQLITE_OPEN_READONLY, readOnlyBusyTimeoutMilliseconds));
+        dbPermanent = std::unique_ptr<SQLite::Database>(new SQLite::Database((fs::path(GetSubDir(true)) / "isto_permanent.sqlite").string(), SQLITE_OPEN_READONLY, readOnlyBusyTimeoutMilliseconds));
+
+        AddExistingRotatingPartitions(); // opened only when needed, as by the writer
+        rotatingPartitionsScannedAt = std::chrono::steady_clock::now();
+    }
+
+    void Storage::Impl::ThrowIfReadOnly() const
+    {
+        if (configuration.readOnly) {
+            throw std::runtime_error("The storage is read-only");
+        }
+    }
+
+    void Storage::Impl::CreateConnectionPoolsIfNeeded()
+    {
+        if (configuration.readConnectionCount == 0) {
+            return;
+        }
+
+        rotatingConnectionPool = std::make_unique<ConnectionPool>(dbRotating->getFilename(), configuration.readConnectionCount);
+        permanentConnectionPool = std::make_unique<ConnectionPool>(dbPermanent->getFilename(), configuration.readConnectionCount);
+    }
+
+    void Storage::Impl::CreateIndexesThatDoNotExist(const std::vector<std::unique_ptr<SQLite::Database>*>& dbs)
+    {
+        for (auto* db : dbs) {
+            (*db)->exec("create index if not exists timestamp_index on DataItems(timestamp)");
+
+            if (configuration.useSegmentFiles) {
+                // needed in order to find out quickly whether a segment file is still needed
+                (*db)->exec("create index if not exists path_index on DataItems(path)");
+            }
+
+            if (configuration.useDynamicTags) {
+                // needed in order to filter by tags
+                (*db)->exec("create index if not exists tag_value_index on DataItemTags(key, value, item)");
+            }
+
+            if (!configuration.rotatingTiers.empty()) {
+                // needed in order to find the oldest items of a tier quickly (see MigrateRotatingDataToLowerTiers)
+                (*db)->exec("create index if not exists tier_timestamp_index on DataItems(tier, timestamp, id)");
+            }
+        }
+
+        // The tag indexes are named after their columns, so we know which ones already exist
+        const std::string tagIndexPrefix = "tag_index__";
+
+        std::unordered_map<std::string, std::string> tagIndexes; // name -> columns
+
+        // The quotas need to find the oldest data of each tag value quickly
+        auto indexedTags = configuration.tagIndexes;
+        if (!configuration.useDynamicTags) {
+            for (const auto& quota : configuration.rotatingDataQuotas) {
+                if (std::find(configuration.tags.begin(), configuration.tags.end(), quota.tag) == configuration.tags.end()) {
+                    throw std::runtime_error("Unknown tag in rotating data quota: " + quota.tag);
+                }
+                indexedTags.push_back({ quota.tag });
+            }
+        }
+
+        for (const auto& tagIndex : indexedTags) {
+            if (tagIndex.empty()) {
+                throw std::runtime_error("A tag index must have at least one tag");
+            }
+
+            std::string name = tagIndexPrefix, columns;
+
+            for (const std::string& tag : tagIndex) {
+                if (std::find(configuration.tags.begin(), configuration.tags.end(), tag) == configuration.tags.end()) {
+                    throw std::runtime_error("Unknown tag in tag index: " + tag);
+                }
+                name += tag + "__";
+                columns += tag + ", ";
+            }
+
+            tagIndexes[name + "timestamp"] = columns + "timestamp";
+        }
+
+        for (auto* db : dbs) {
+            std::deque<std::string> obsoleteTagIndexes;
+
+            SQLite::Statement query(**db, "select name from sqlite_master where type = 'index' and tbl_name = 'DataItems'");
+            while (query.executeStep()) {
+                const std::string name = query.getColumn(0).getText();
+                if (name.compare(0, tagIndexPrefix.length(), tagIndexPrefix) == 0 && tagIndexes.find(name) == tagIndexes.end()) {
+                    obsoleteTagIndexes.push_back(name);
+                }
+            }
+
+            for (const std::string& name : obsoleteTagIndexes) {
+                (*db)->exec("drop index " + name);
+            }
+
+            for (const auto& tagIndex : tagIndexes) {
+                (*db)->exec("create index if not exists " + tagIndex.first + " on DataItems(" + tagIndex.second + ")");
+            }
+        }
+    }
+
+    void Storage::Impl::CreateTablesThatDoNotExist(const std::vector<std::unique_ptr<SQLite::Database>*>& dbs)
+    {
+        std::ostringstream createTableStatement;
+        createTableStatement << "create table if not exists DataItems (id text primary key, timestamp integer, path text, size integer";
+
+        for (const std::string& tag : configuration.tags) {
+            if (tag.find_first_of(" \t\n") != std::string::npos) {
+                throw std::runtime_error("Tag names must not contain whitespace");
+            }
+            createTableStatement << ", " << tag << " text";
+        }
+
+        createTableStatement << ")";
+
+        for (auto* db : dbs) {
+            (*db)->exec(createTableStatement.str());
+        }
+
+        if (configuration.useDynamicTags) {
+            if (!configuration.tags.empty()) {
+                throw std::runtime_error("Tags must not be configured when using dynamic tags");
+            }
+
+            // The tag names and values are interned in dictionary tables, and the items refer to them by id
+            // - NB: the trigger is not fired when a row is replaced (unless recursive triggers are enabled),
+            //   so InsertDataItem deletes the old row first
+            for (auto* db : dbs) {
+                (*db)->exec("create table if not exists TagKeys (id integer primary key, name text unique)");
+                (*db)->exec("create table if not exists TagValues (id integer primary key, value text unique)");
+                (*db)->exec("create table if not exists DataItemTags (item text, key integer, value integer, primary key (item, key)) without rowid");
+                (*db)->exec("create trigger if not exists delete_data_item_tags after delete on DataItems begin delete from DataItemTags where item = old.id; end");
+            }
+        }
+    }
+
+    void Storage::Impl::AddColumnsThatDoNotExist(const std::vector<std::unique_ptr<SQLite::Database>*>& dbs)
+    {
+        // Columns added after the initial version of the schema
+        const std::vector<std::pair<std::string, std::string>> columns = {
+            { "segment_offset", "integer" }, // null if the payload is in a file of its own
+            { "pinned", "integer not null default 0" }, // see Storage::Pin
+            { "tier", "integer not null default 0" } // see Configuration::rotatingTiers
+        };
+
+        for (auto* db : dbs) {
+            std::unordered_set<std::string> existingColumns;
+
+            SQLite::Statement query(**db, "pragma table_info(DataItems)");
+            while (query.executeStep()) {
+                existingColumns.insert(query.getColumn(1).getText());
+            }
+
+            for (const auto& column : columns) {
+                if (existingColumns.find(column.first) == existingColumns.end()) {
+                    (*db)->exec("alter table DataItems add column " + column.first + " " + column.second);
+                }
+            }
+        }
+    }
+
+    void Storage::Impl::ConvertTextTimestampsToIntegers()
+    {
+        // Databases created by earlier versions store the timestamps as text - convert them once
+        bool converted = false;
+
+        for (auto* db : { &dbRotating, &dbPermanent }) {
+            std::ostringstream columnDefinitions;
+            std::string columnNames;
+            bool hasTextTimestamps = false;
+
+            {
+                SQLite::Statement query(**db, "pragma table_info(DataItems)");
+                while (query.executeStep()) {
+                    const std::string name = query.getColumn(1).getText();
+                    std::string type = query.getColumn(2).getText();
+                    const bool isNotNull = query.getColumn(3).getInt() != 0;
+                    const bool hasDefault = !query.getColumn(4).isNull();
+                    const bool isPrimaryKey = query.getColumn(5).getInt() > 0;
+
+                    if (name == "timestamp") {
+                        std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+                        hasTextTimestamps = type == "text";
+                        type = "integer";
+                    }
+
+                    columnDefinitions << (columnDefinitions.tellp() > 0 ? ", " : "") << name << " " << type
+                        << (isPrimaryKey ? " primary key" : "")
+                        << (isNotNull ? " not null" : "")
+                        << (hasDefault ? " default " + std::string(query.getColumn(4).getText()) : "");
+
+                    columnNames += (columnNames.empty() ? "" : ", ") + name;
+                }
+            }
+
+            if (!hasTextTimestamps) {
+                continue;
+            }
+
+            // The triggers are dropped along with the table
+            std::vector<std::string> createTriggerStatements;
+            {
+                SQLite::Statement query(**db, "select sql from sqlite_master where type = 'trigger' and tbl_name = 'DataItems'");
+                while (query.executeStep()) {
+                    createTriggerStatements.push_back(query.getColumn(0).getText());
+                }
+            }
+
+            // A column type cannot be altered, so copy everything to a new table
+            // - keeping the rowids, too
+            (*db)->exec("create table DataItems_converted (" + columnDefinitions.str() + ")");
+            (*db)->exec("insert into DataItems_converted (rowid, " + columnNames + ") select rowid, " + columnNames + " from DataItems");
+
+            {
+                SQLite::Statement select(**db, "select id, timestamp from DataItems");
+                SQLite::Statement update(**db, "update DataItems_converted set timestamp = @timestamp where id = @id");
+
+                while (select.executeStep()) {
+                    const std::string id = select.getColumn(0).getText();
+                    const std::string timestamp = select.getColumn(1).getText();
+
+                    update.bind(1, ToMicroseconds(system_clock_time_point_string_conversion::from_string(timestamp)));
+                    update.bind(2, id);
+                    update.executeStep();
+                    update.clearBindings();
+                    update.reset();
+                }
+            }
+
+            (*db)->exec("drop table DataItems"); // drops the old indexes, too
+            (*db)->exec("alter table DataItems_converted rename to DataItems");
+
+            for (const std::string& createTriggerStatement : createTriggerStatements) {
+                (*db)->exec(createTriggerStatement);
+            }
+
+            converted = true;
+        }
+
+        if (converted) {
+            // Commit right away, so that the conversion is done only once
+            CreateIndexesThatDoNotExist({ &dbRotating, &dbPermanent });
+            FlushRotating();
+            FlushPermanent();
+        }
+    }
+
+    std::string Storage::Impl::GetInsertStatement() const
+    {
+        std::ostringstream insertStatement;
+        insertStatement << "insert or replace into DataItems (id, timestamp, path, size, segment_offset, tier";
+
+        for (const std::string& tag : configuration.tags) {
+            insertStatement << ", " << tag;
+        }
+
+        insertStatement << ") values (@id, @timestamp, @path, @size, @segment_offset, @tier";
+
+        for (const std::string& tag : configuration.tags) {
+            insertStatement << ", @" << tag;
+        }
+
+        insertStatement << ")";
+
+        return insertStatement.str();
+    }
+
+    void Storage::Impl::CreateStatements()
+    {
+        insertRotating = std::unique_ptr<SQLite::Statement>(new SQLite::Statement(*dbRotating, GetInsertStatement()));
+        insertPermanent = std::unique_ptr<SQLite::Statement>(new SQLite::Statement(*dbPermanent, GetInsertStatement()));
+    }
+
+    void Storage::Impl::InitializeCurrentDataItemBytes()
+    {
+        currentRotatingDataItemBytes = 0;
+
+        for (const auto& db : GetRotatingDatabases()) {
+            SQLite::Statement query(**db, "select sum(size) from DataItems");
+
+            if (!query.executeStep()) {
+                throw std::runtime_error("Unable to initialize current data item bytes");
+            }
+
+            currentRotatingDataItemBytes += query.getColumn(0).getInt64();
+        }
+
+        CountQuotaAndTierBytes();
+    }
+
+    bool Storage::Impl::DeleteExcessRotatingData(size_t sizeToBeInserted)
+    {
+        RefreshRotatingDiskSpaceIfNeeded(sizeToBeInserted);
+
+        const auto hasExcessData = [&]() {
+            return currentRotatingDataItemBytes + sizeToBeInserted > configuration.maxRotatingDataToKeepInGiB * 1024 * 1024 * 1024
+                || IsFreeDiskSpaceBelow(configuration.minFreeDiskSpaceInGiB * 1024 * 1024 * 1024, 0.0, sizeToBeInserted);
+        };
+
+        if (configuration.useBackgroundEviction && IsAboveEvictionHighWatermark(sizeToBeInserted)) {
+            WakeUpEvictionThread();
+        }
+        else if (configuration.rotatingTiers.size() > 1 && currentTierBytes[0] + sizeToBeInserted > configuration.rotatingTiers[0].maxDataInGiB * 1024 * 1024 * 1024) {
+            WakeUpEvictionThread(); // in order to migrate
+        }
+
+        if (hasExcessData()) {
+            DeleteOldestRotatingData(hasExcessData, std::numeric_limits<unsigned int>::max());
+        }
+
+        return !hasExcessData();
+    }
+
+    void Storage::Impl::CreateRotatingVolumes()
+    {
+        if (!configuration.rotatingStripes.empty()) {
+            if (!configuration.rotatingTiers.empty() || configuration.useSegmentFiles) {
+                throw std::runtime_error("The rotating stripes cannot be used together with rotating tiers or segment files");
+            }
+            for (const std::string& directory : configuration.rotatingStripes) {
+                fs::create_directories(directory);
+                rotatingVolumes.push_back(RotatingVolume());
+                rotatingVolumes.back().directory = fs::path(directory).string();
+            }
+        }
+        else {
+            // the data is deleted from the last tier, so that's where the free space matters
+            rotatingVolumes.push_back(RotatingVolume());
+            rotatingVolumes.back().directory = GetTierDirectory(configuration.rotatingTiers.empty() ? 0 : configuration.rotatingTiers.size() - 1);
+        }
+    }
+
+    Storage::Impl::RotatingVolume& Storage::Impl::GetRotatingVolume(const std::string& path)
+    {
+        if (rotatingVolumes.size() > 1) {
+            for (RotatingVolume& volume : rotatingVolumes) {
+                const auto relativePath = fs::path(path).lexically_relative(volume.directory);
+                if (!relativePath.empty() && *relativePath.begin() != "..") {
+                    return volume;
+                }
+            }
+        }
+
+        return rotatingVolumes.front();
+    }
+
+    std::string Storage::Impl::ChooseRotatingRootDirectory()
+    {
+        if (configuration.rotatingStripes.empty()) {
+            return GetTierDirectory(0);
+        }
+
+        switch (configuration.stripingPolicy) {
+        case Configuration::StripingPolicy::LeastFull: {
+            const auto mostFree = std::max_element(rotatingVolumes.begin(), rotatingVolumes.end(), [](const RotatingVolume& a, const RotatingVolume& b) {
+                return a.space.free < b.space.free;
+            });
+            return mostFree->directory;
+        }
+        case Configuration::StripingPolicy::RoundRobin:
+        default:
+            return rotatingVolumes[nextStripe++ % rotatingVolumes.size()].directory;
+        }
+    }
+
+    void Storage::Impl::RefreshRotatingDiskSpaceIfNeeded(size_t sizeToBeInserted)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        const double bytesPerGiB = 1024.0 * 1024 * 1024;
+
+        for (RotatingVolume& volume : rotatingVolumes) {
+            double freeSpaceLimit = configuration.minFreeDiskSpaceInGiB * bytesPerGiB;
+            if (configuration.useBackgroundEviction) {
+                freeSpaceLimit = std::max(freeSpaceLimit, configuration.evictionStartFreeDiskPercent / 100.0 * volume.space.capacity);
+            }
+
+            const bool isNearLimit = volume.space.free < sizeToBeInserted + freeSpaceLimit + configuration.freeDiskSpaceSafetyMarginInGiB * bytesPerGiB;
+            const bool isCheckDue = now - volume.checkedAt >= std::chrono::duration<double>(configuration.freeDiskSpaceCheckIntervalSeconds);
+
+            if (isNearLimit || isCheckDue) {
+                volume.space = fs::space(fs::path(volume.directory));
+                volume.checkedAt = now;
+            }
+        }
+    }
+
+    bool Storage::Impl::IsFreeDiskSpaceBelow(double bytes, double percent, size_t sizeToBeInserted) const
+    {
+        return std::any_of(rotatingVolumes.begin(), rotatingVolumes.end(), [&](const RotatingVolume& volume) {
+            const double free = static_cast<double>(volume.space.free) - sizeToBeInserted;
+            return free < bytes || free < percent / 100.0 * volume.space.capacity;
+        });
+    }
+
+    unsigned int Storage::Impl::DeleteOldestRotatingData(const std::function<bool()>& hasExcessData, unsigned int maxItemsToDelete, const tags_t& tags, int64_t endTime)
+    {
+        unsigned int totalDeleteCounter = 0;
+
+        const unsigned int batchSize = std::max(configuration.deletionFlushInterval, 1u);
+
+        // The pinned items that cannot be made permanent (e.g., as a permanent item of the same id exists) are stepped over,
+        // so that they do not keep the newer items from being deleted
+        int64_t afterTimestamp = std::numeric_limits<int64_t>::min();
+        std::string afterId;
+        const std::string afterCondition = " and timestamp >= @after_timestamp and (timestamp > @after_timestamp or id > @after_id)";
+
+        while (totalDeleteCounter < maxItemsToDelete && hasExcessData()) {
+            if (DropOldestRotatingPartitionIfExcess(hasExcessData, tags, endTime, totalDeleteCounter)) {
+                continue;
+            }
+
+            // Find out how many of the oldest items need to go
+            std::unique_ptr<SQLite::Database>* db = nullptr;
+            std::vector<ItemRecord> batch;
+            std::unordered_set<std::string> pinnedIds;
+
+            // The partitions do not overlap, so the oldest items are in the oldest partition that has any matching items
+            // - the end time is exclusive, so a partition that begins at it has nothing to delete
+            for (const auto& candidate : GetRotatingDatabases(afterTimestamp, endTime - 1)) {
+                db = &*candidate;
+
+                SQLite::Statement& query = GetStatement(*db, "select " + GetItemRecordColumns() + ", pinned from DataItems"
+                    " where timestamp < @end_time" + afterCondition + GetTagConditions(tags) + " order by timestamp, id limit @limit");
+                const int pinnedColumn = query.getColumnCount() - 1;
+
+                int index = 0;
+                query.bind(++index, endTime);
+                query.bind(++index, afterTimestamp);
+                query.bind(++index, afterId);
+                BindTagConditions(query, index, tags);
+                query.bind(++index, static_cast<long long>(std::min(batchSize, maxItemsToDelete - totalDeleteCounter)));
+
+                std::vector<ItemRecord> candidates;
+
+                while (query.executeStep()) {
+                    candidates.push_back(GetItemRecord(*db, query));
+
+                    if (query.getColumn(pinnedColumn).getInt() != 0) {
+                        pinnedIds.insert(candidates.back().id);
+                    }
+                }
+
+                // The statement is shared, and this may be re-entered via MoveDataItems below
+                query.reset();
+
+                ReadDynamicTags(*db, candidates.data(), candidates.size());
+
+                for (const ItemRecord& record : candidates) {
+                    if (!hasExcessData()) {
+                        break;
+                    }
+
+                    assert(currentRotatingDataItemBytes >= record.location.size);
+
+                    // tentatively, so that hasExcessData() knows when to stop
+                    currentRotatingDataItemBytes -= record.location.size;
+                    SubtractQuotaAndTierBytes(record.tags, record.tier, record.location.size);
+                    GetRotatingVolume(record.location.path).space.free += GetFreedDiskSpace(record);
+
+                    batch.push_back(record);
+                }
+
+                if (!batch.empty()) {
+                    break;
+                }
+            }
+
+            if (batch.empty()) {
+                break;
+            }
+
+            for (const ItemRecord& record : batch) {
+                currentRotatingDataItemBytes += record.location.size;
+                AddQuotaAndTierBytes(record.tags, record.tier, record.location.size);
+                GetRotatingVolume(record.location.path).space.free -= GetFreedDiskSpace(record);
+            }
+
+            if (!pinnedIds.empty()) {
+                // Make the pinned items permanent, instead of deleting them
+                const std::vector<std::string> ids(pinnedIds.begin(), pinnedIds.end());
+                const size_t movedItemCount = MoveDataItems(false, true, ids);
+
+                const ItemRecord last = batch.back();
+
+                const auto isPinned = [&](const ItemRecord& record) { return pinnedIds.find(record.id) != pinnedIds.end(); };
+                batch.erase(std::remove_if(batch.begin(), batch.end(), isPinned), batch.end());
+
+                if (batch.empty()) {
+                    if (movedItemCount == 0) {
+                        // None of them can be moved, so continue after them
+                        afterTimestamp = ToMicroseconds(last.timestamp);
+                        afterId = last.id;
+                    }
+                    continue;
+                }
+            }
+
+            // Delete the metadata of the whole batch at once (the pinned items, if any, are already gone)
+            SQLite::Statement& deleteBatch = GetStatement(*db,
+                "delete from DataItems where timestamp <= @last_timestamp and (timestamp < @last_timestamp or id <= @last_id)"
+                + afterCondition + " and pinned = 0" + GetTagConditions(tags));
+            int index = 0;
+            deleteBatch.bind(++index, ToMicroseconds(batch.back().timestamp));
+            deleteBatch.bind(++index, batch.back().id);
+            deleteBatch.bind(++index, afterTimestamp);
+            deleteBatch.bind(++index, afterId);
+            BindTagConditions(deleteBatch, index, tags);
+            const int deleted = deleteBatch.exec();
+            assert(deleted == static_cast<int>(batch.size()));
+            (void)deleted;
+
+            if (RotatingPartition* partition = FindCountedRotatingPartition(*db)) {
+                for (const ItemRecord& record : batch) {
+                    CountRotatingItem(*partition, record.location.path, record.location.size, record.location.IsInSegmentFile(), false, false);
+                }
+            }
+
+            // Commit first, so that the readers (see Configuration::readConnectionCount) no longer find the files to be deleted
+            FlushRotating();
+
+            FinishDeletingRotatingData(batch);
+
+            totalDeleteCounter += static_cast<unsigned int>(batch.size());
+
+            if (IsRotatingMetadataPartitioned()) {
+                // NB: the statement is not shared, so that it need not be reset before the partition is dropped
+                SQLite::Statement query(**db, "select 1 from DataItems limit 1");
+                if (!query.executeStep()) {
+                    query.reset();
+                    DropRotatingPartition(FindRotatingPartition(ToMicroseconds(batch.back().timestamp))->begin);
+                }
+            }
+        }
+
+        return totalDeleteCounter;
+    }
+
+    bool Storage::Impl::DropOldestRotatingPartitionIfExcess(const std::function<bool()>& hasExcessData, const tags_t& tags, int64_t endTime, unsigned int& deleteCounter)
+    {
+        if (!IsRotatingMetadataPartitioned() || rotatingPartitions.empty() || !tags.empty()) {
+            return false;
+        }
+
+        RotatingPartition& oldest = rotatingPartitions.begin()->second;
+        if (oldest.end > endTime) {
+            return false; // some of the items may be too new
+        }
+
+        CountRotatingPartition(oldest);
+
+        if (oldest.pinnedItems > 0) {
+            return false; // they need to be made permanent first
+        }
+
+        auto& db = GetRotatingPartitionDatabase(oldest);
+
+        // The whole partition can go, if there would still be excess data after deleting all but its newest item
+        // - decided by the totals of the partition, so that its items are read only when it is actually dropped
+        uintmax_t totalBytes = oldest.bytes;
+        std::map<RotatingVolume*, uintmax_t> freedBytes = oldest.fileBytes;
+
+        {
+            SQLite::Statement& newest = GetStatement(db, "select path, size, segment_offset from DataItems order by timestamp desc, id desc limit 1");
+
+            if (newest.executeStep()) {
+                const uintmax_t size = newest.getColumn(1).getInt64();
+                totalBytes -= std::min(totalBytes, size);
+
+                if (newest.getColumn(2).isNull()) {
+                    auto& bytes = freedBytes[&GetRotatingVolume(newest.getColumn(0).getText())];
+                    bytes -= std::min(bytes, size);
+                }
+            }
+
+            newest.reset();
+        }
+
+        assert(currentRotatingDataItemBytes >= totalBytes);
+
+        const auto adjust = [&](bool subtract) {
+            if (subtract) {
+                currentRotatingDataItemBytes -= totalBytes;
+            }
+            else {
+                currentRotatingDataItemBytes += totalBytes;
+            }
+            for (const auto& i : freedBytes) {
+                if (subtract) {
+                    i.first->space.free += i.second;
+                }
+                else {
+                    i.first->space.free -= i.second;
+                }
+            }
+        };
+
+        adjust(true);
+        const bool isWholePartitionExcess = hasExcessData();
+        adjust(false);
+
+        if (!isWholePartitionExcess) {
+            return false;
+        }
+
+        // The records are still needed for the payloads, and for the callbacks
+        std::vector<ItemRecord> records;
 
-        SQLite::Statement query(*db, select);
+        {
+            SQLite::Statement query(*db, "select " + GetItemRecordColumns() + " from DataItems order by timestamp, id");
+            while (query.executeStep()) {
+                records.push_back(GetItemRecord(db, query));
+            }
+        }
 
-        std::deque<std::future<std::unique_ptr<DataItem>>> futures;
+        ReadDynamicTags(db, records.data(), records.size());
 
-        while (query.executeStep()) {
-            const std::string id = query.getColumn(0);
-            const auto preferredLaunchMode = futures.empty() ? std::launch::deferred : std::launch::async;
-            futures.emplace_back(GetData(db, id, preferredLaunchMode));
-        }
+        // No need to commit first: the file is simply removed
+        DropRotatingPartition(rotatingPartitions.begin()->first);
 
-        DataItems dataItems;
-        dataItems.reserve(futures.size());
+        FinishDeletingRotatingData(records);
 
-        for (auto& future : futures) {
-            dataItems.emplace_back(FromFuture(future));
-        }
+        deleteCounter += static_cast<unsigned int>(records.size());
 
-        return dataItems;
+        return true;
     }
 
-    std::pair<std::string, std::unique_ptr<SQLite::Database>&> Storage::Impl::FindMatchingTimestampAndCorrespondingDatabase(
-        const std::chrono::system_clock::time_point& timestamp,
-        const std::string& comparisonOperator,
-        const tags_t& tags)
+    void Storage::Impl::FinishDeletingRotatingData(const std::vector<ItemRecord>& deletedRotatingItems)
     {
-        const std::string timestampString = system_clock_time_point_string_conversion::to_string(timestamp);
+        DeletePayloads(deletedRotatingItems);
 
-        const auto noResult = [this]() {
-            return std::pair<std::string, std::unique_ptr<SQLite::Database>&>("", dbNone);
-        };
+        for (const ItemRecord& record : deletedRotatingItems) {
+            hotItemCache.Erase(record.id);
 
-        const auto getRotatingAndPermanentTimestamps = [&](const std::string& select) {
-            std::string rotatingTimestamp, permanentTimestamp;
-            SQLite::Statement queryRotating(*dbRotating, select);
-            SQLite::Statement queryPermanent(*dbPermanent, select);
-            if (queryRotating.executeStep()) {
-                rotatingTimestamp = queryRotating.getColumn(0).getText();
-            }
-            if (queryPermanent.executeStep()) {
-                permanentTimestamp = queryPermanent.getColumn(0).getText();
-            }
-            return std::pair<std::string, std::string>(rotatingTimestamp, permanentTimestamp);
-        };
+            currentRotatingDataItemBytes -= record.location.size;
+            SubtractQuotaAndTierBytes(record.tags, record.tier, record.location.size);
+            GetRotatingVolume(record.location.path).space.free += GetFreedDiskSpace(record);
 
-        if (comparisonOperator == "<" || comparisonOperator == "<=" || comparisonOperator == ">=" || comparisonOperator == ">") {
-            std::string select = "select ";
-            if (comparisonOperator == "<" || comparisonOperator == "<=") {
-                select += "max(timestamp)";
+            if (rotatingDataDeletedCallback != nullptr) {
+                rotatingDataDeletedCallback(record.id);
             }
-            else {
-                select += "min(timestamp)";
+        }
+    }
+
+    void Storage::Impl::DeletePayloads(const std::vector<ItemRecord>& deletedRotatingItems)
+    {
+        // Group the files by directory; the segment files may be shared by several items
+        std::map<std::string, std::vector<const ItemRecord*>> directories;
+        std::set<std::string> segmentPaths;
+
+        for (const ItemRecord& record : deletedRotatingItems) {
+            directories[fs::path(record.location.path).parent_path().string()].push_back(&record);
+            if (record.location.IsInSegmentFile()) {
+                segmentPaths.insert(record.location.path);
             }
-            select += " from DataItems where timestamp " + comparisonOperator + "'" + timestampString + "'";
+        }
+
+        std::vector<std::future<void>> deleteOperations;
 
-            for (const auto& tag : tags) {
-                select += " and " + tag.first + " = '" + tag.second + "'";
+        // The space of a segment file is freed only when the whole file is deleted (see GetFreedDiskSpace)
+        const auto creditSegmentFile = [this](const std::string& segmentPath) {
+            std::error_code error;
+            const uintmax_t size = fs::file_size(segmentPath, error);
+            if (!error) {
+                GetRotatingVolume(segmentPath).space.free += size;
             }
+        };
 
-            const auto matchedTimestamps = getRotatingAndPermanentTimestamps(select);
-            if (!matchedTimestamps.first.empty() && !matchedTimestamps.second.empty()) {
-                const auto rotatingTimestamp = system_clock_time_point_string_conversion::from_string(matchedTimestamps.first);
-                const auto permanentTimestamp = system_clock_time_point_string_conversion::from_string(matchedTimestamps.second);
-                if (abs((rotatingTimestamp - timestamp).count()) < abs((permanentTimestamp - timestamp).count())) {
-                    return std::pair<std::string, std::unique_ptr<SQLite::Database>&>(matchedTimestamps.first, dbRotating);
-                }
-                else {
-                    return std::pair<std::string, std::unique_ptr<SQLite::Database>&>(matchedTimestamps.second, dbPermanent);
+        for (const auto& directory : directories) {
+            const auto& items = directory.second;
+
+            if (IsWholeBucketDeleted(directory.first, items.front()->timestamp, GetRootDirectory(*items.front()))) {
+                for (const std::string& segmentPath : segmentPaths) {
+                    if (fs::path(segmentPath).parent_path() == directory.first) {
+                        creditSegmentFile(segmentPath);
+                    }
                 }
+
+                // Drop the whole minute, hour or day at once
+                const fs::path path = directory.first;
+                deleteOperations.push_back(ioThreadPool.Run([path]() {
+                    RemoveFileAndEmptyParentDirectories(path);
+                }));
+                continue;
             }
-            else if (!matchedTimestamps.first.empty()) {
-                return std::pair<std::string, std::unique_ptr<SQLite::Database>&>(matchedTimestamps.first, dbRotating);
-            }
-            else if (!matchedTimestamps.second.empty()) {
-                return std::pair<std::string, std::unique_ptr<SQLite::Database>&>(matchedTimestamps.second, dbPermanent);
-            }
-            else {
-                return noResult();
-            }
-        }
-        else if (comparisonOperator == "==") {
-            const auto bestPrevious = FindMatchingTimestampAndCorrespondingDatabase(timestamp, "<=", tags);
-            if (bestPrevious.first == timestampString) {
-                return bestPrevious;
-            }
-            else {
-                return noResult();
-            }
-        }
-        else if (comparisonOperator == "~") {
-            const auto bestPrevious = FindMatchingTimestampAndCorrespondingDatabase(timestamp, "<=", tags);
-            const auto bestNext = FindMatchingTimestampAndCorrespondingDatabase(timestamp, ">=", tags);
-            if (!bestPrevious.first.empty() && !bestNext.first.empty()) {
-                const auto previousTimestamp = system_clock_time_point_string_conversion::from_string(bestPrevious.first);
-                const auto nextTimestamp = system_clock_time_point_string_conversion::from_string(bestNext.first);
-                if (abs((previousTimestamp - timestamp).count()) <= abs((nextTimestamp - timestamp).count())) {
-                    return bestPrevious;
-                }
-                else {
-                    return bestNext;
+
+            std::vector<fs::path> paths;
+            for (const ItemRecord* record : items) {
+                if (!record->location.IsInSegmentFile()) {
+                    paths.push_back(record->location.path);
                 }
             }
-            else if (!bestPrevious.first.empty()) {
-                return bestPrevious;
-            }
-            else if (!bestNext.first.empty()) {
-                return bestNext;
+            for (const std::string& segmentPath : segmentPaths) {
+                if (fs::path(segmentPath).parent_path() == directory.first && !IsSegmentReferenced(segmentPath)) {
+                    creditSegmentFile(segmentPath);
+                    paths.push_back(segmentPath);
+                }
             }
-            else {
-                return noResult();
+
+            if (!paths.empty()) {
+                deleteOperations.push_back(ioThreadPool.Run([paths]() {
+                    for (const auto& path : paths) {
+                        RemoveFileAndEmptyParentDirectories(path);
+                    }
+                }));
             }
         }
-        else {
-            return noResult();
-        }
-    }
-
-    std::string Storage::Impl::GetDirectory(bool isPermanent, const timestamp_t& timestamp, Configuration::DirectoryStructureResolution resolution) const
-    {
-        const std::string timestampString = system_clock_time_point_string_conversion::to_string(timestamp);
-
-        const auto getDaysDirectory = [&]() {
-            return fs::path(GetSubDir(isPermanent)) / timestampString.substr(0, 10);
-        };
-        const auto getHoursDirectory = [&]() {
-            return getDaysDirectory() / timestampString.substr(11, 2);
-        };
-        const auto getMinutesDirectory = [&]() {
-            return getHoursDirectory() / timestampString.substr(14, 2);
-        };
 
-        switch (resolution) {
-        case Configuration::DirectoryStructureResolution::Minutes: return getMinutesDirectory().string();
-        case Configuration::DirectoryStructureResolution::Hours:   return getHoursDirectory()  .string();
-        case Configuration::DirectoryStructureResolution::Days:    return getDaysDirectory()   .string();
-        default: throw std::runtime_error("Unknown directory structure resolution: " + std::to_string(static_cast<int>(resolution)));
+        for (auto& deleteOperation : deleteOperations) {
+            deleteOperation.get(); // wait until the files and the empty subdirs (if any) have really been deleted
         }
     }
 
-    std::string Storage::Impl::GetPath(bool isPermanent, const timestamp_t& timestamp, const std::string& id, Configuration::DirectoryStructureResolution resolution) const
+    uintmax_t Storage::Impl::GetFreedDiskSpace(const ItemRecord& deletedRotatingItem) const
     {
-        // note that the id doubles as a filename
-        return (fs::path(GetDirectory(isPermanent, timestamp, resolution)) / id).string();
+        // The payloads in a segment file take up space until the whole segment is deleted (see DeletePayloads)
+        return deletedRotatingItem.location.IsInSegmentFile() ? 0 : deletedRotatingItem.location.size;
     }
 
-    bool Storage::Impl::MakePermanent(const std::string& id)
+    std::string Storage::Impl::GetRootDirectory(const ItemRecord& rotatingItem)
     {
-        return MoveDataItem(false, true, id);
+        if (!configuration.rotatingTiers.empty()) {
+            return GetTierDirectory(rotatingItem.tier);
+        }
+        if (!configuration.rotatingStripes.empty()) {
+            return GetRotatingVolume(rotatingItem.location.path).directory;
+        }
+        return GetSubDir(false);
     }
 
-    bool Storage::Impl::MakeRotating(const std::string& id)
+    bool Storage::Impl::IsWholeBucketDeleted(const std::string& directory, const timestamp_t& timestamp, const std::string& rootDirectory)
     {
-        return MoveDataItem(true, false, id);
-    }
+        // The same structure in each tier and stripe
+        const auto getDirectory = [&](const timestamp_t& timestamp) {
+            return fs::path(GetDirectory(rootDirectory, timestamp, configuration.directoryStructureResolution));
+        };
 
-    bool Storage::Impl::MoveDataItem(bool sourceIsPermanent, bool destinationIsPermanent, const std::string& id)
-    {
-        assert(sourceIsPermanent != destinationIsPermanent);
+        // Only if the directory is what the current directory structure resolution says it should be
+        if (fs::path(directory) != getDirectory(timestamp)) {
+            return false;
+        }
+
+        // Keep the segment files that are still being written to
+        for (const bool isPermanent : { false, true }) {
+            const ActiveSegment& segment = GetActiveSegment(isPermanent);
+            if (segment.file && fs::path(segment.directory) == fs::path(directory)) {
+                return false;
+            }
+        }
+
+        // Find out the time range that maps to the directory
+        const auto bucketDuration = [&]() -> std::chrono::microseconds {
+            switch (configuration.directoryStructureResolution) {
+            case Configuration::DirectoryStructureResolution::Minutes: return std::chrono::minutes(1);
+            case Configuration::DirectoryStructureResolution::Hours:   return std::chrono::hours(1);
+            default:                                                   return std::chrono::hours(24);
+            }
+        }();
 
-        // TODO: could be optimized by moving the file (see fs::rename) - instead of reading, writing, and deleting
+        const int64_t begin = ToMicroseconds(timestamp) / bucketDuration.count() * bucketDuration.count();
+        const int64_t end = begin + bucketDuration.count();
 
-        std::unique_ptr<SQLite::Database>& dbSource = GetDatabase(sourceIsPermanent);
+        // The directory names may be in local time, so double-check that the range is exactly right
+        const auto isInDirectory = [&](int64_t microseconds) {
+            return getDirectory(FromMicroseconds(microseconds)) == fs::path(directory);
+        };
 
-        const DataItem dataItem = FromFuture(GetData(dbSource, id, std::launch::deferred));
-        if (!dataItem.isValid) {
+        if (!isInDirectory(begin) || !isInDirectory(end - 1) || isInDirectory(begin - 1) || isInDirectory(end)) {
             return false;
         }
-        else {
-            assert(dataItem.isPermanent != destinationIsPermanent);
 
-            const bool isSourceSameAsDestination = configuration.permanentDirectory == configuration.rotatingDirectory;
-
-            const auto updateRotatingDataItemBytes = [&]() {
-                const auto size = dataItem.data.size();
-                if (sourceIsPermanent) {
-                    currentRotatingDataItemBytes += size;
-                }
-                else {
-                    assert(currentRotatingDataItemBytes >= size);
-                    currentRotatingDataItemBytes -= size;
-                }
-            };
+        const auto hasItemsInBucket = [&](std::unique_ptr<SQLite::Database>& db) {
+            SQLite::Statement& query = GetStatement(db, "select 1 from DataItems where timestamp >= @begin and timestamp < @end limit 1");
+            query.bind(1, begin);
+            query.bind(2, end);
+            return query.executeStep();
+        };
 
-            if (isSourceSameAsDestination) {
-                const std::string noPayload;
-                DataItem newItem(dataItem.id, noPayload, dataItem.timestamp, destinationIsPermanent, dataItem.tags);
-                InsertDataItem(newItem);
-                int deleted = dbSource->exec("delete from DataItems where id = '" + id + "'");
-                assert(deleted == 1);
-                Flush(GetDatabase(sourceIsPermanent));
-                updateRotatingDataItemBytes();
-                return true;
+        for (const auto& db : GetRotatingDatabases(begin, end - 1)) {
+            if (hasItemsInBucket(*db)) {
+                return false;
             }
-            else {
-                const DataItem newDataItem(dataItem.id, dataItem.data, dataItem.timestamp, destinationIsPermanent, dataItem.tags);
-                if (SaveData(newDataItem, false)) {
-                    DeleteItem(sourceIsPermanent, dataItem.timestamp, dataItem.id);
-                    Flush(GetDatabase(sourceIsPermanent));
-                    updateRotatingDataItemBytes();
-                    return true;
-                }
-                else {
-                    return false;
-                }
+        }
+
+        // the rotating and the permanent directories may be the same
+        if (fs::path(GetSubDir(false)) == fs::path(GetSubDir(true)) && hasItemsInBucket(dbPermanent)) {
+            return false;
+        }
+
+        return true;
+    }
+
+    namespace {
+        bool MatchesQuota(const Configuration::RotatingDataQuota& quota, const tags_t& tags)
+        {
+            const auto tag = tags.find(quota.tag);
+            return tag != tags.end() && tag->second == quota.value;
+        }
+    }
+
+    void Storage::Impl::AddQuotaAndTierBytes(const tags_t& tags, unsigned int tier, uintmax_t size)
+    {
+        for (size_t i = 0, end = configuration.rotatingDataQuotas.size(); i < end; ++i) {
+            if (MatchesQuota(configuration.rotatingDataQuotas[i], tags)) {
+                currentQuotaBytes[i] += size;
             }
         }
+
+        if (tier < currentTierBytes.size()) {
+            currentTierBytes[tier] += size;
+        }
     }
 
-    void Storage::Impl::DeleteItem(bool isPermanent, const timestamp_t& timestamp, const std::string& id)
+    void Storage::Impl::SubtractQuotaAndTierBytes(const tags_t& tags, unsigned int tier, uintmax_t size)
     {
-        std::future<void> fileDeleteOperation = std::async(std::launch::async, [&]() {
+        for (size_t i = 0, end = configuration.rotatingDataQuotas.size(); i < end; ++i) {
+            if (MatchesQuota(configuration.rotatingDataQuotas[i], tags)) {
+                assert(currentQuotaBytes[i] >= size);
+                currentQuotaBytes[i] -= size;
+            }
+        }
 
-            fs::path sourcePath = GetPath(isPermanent, timestamp, id, configuration.directoryStructureResolution);
-            fs::remove(sourcePath);
+        if (tier < currentTierBytes.size()) {
+            assert(currentTierBytes[tier] >= size);
+            currentTierBytes[tier] -= size;
+        }
+    }
 
-            try {
-                while (sourcePath.has_parent_path()) {
-                    sourcePath = sourcePath.parent_path();
-                    if (fs::is_empty(sourcePath)) {
-                        fs::remove(sourcePath);
-                    }
-                    else {
-                        break;
+    void Storage::Impl::CountQuotaAndTierBytes()
+    {
+        currentQuotaBytes.assign(configuration.rotatingDataQuotas.size(), 0);
+        currentTierBytes.assign(configuration.rotatingTiers.size(), 0);
+
+        for (const auto& db : GetRotatingDatabases()) {
+            if (!configuration.rotatingTiers.empty()) {
+                SQLite::Statement query(**db, "select tier, sum(size) from DataItems group by tier");
+                while (query.executeStep()) {
+                    const auto tier = static_cast<size_t>(query.getColumn(0).getInt64());
+                    if (tier < currentTierBytes.size()) {
+                        currentTierBytes[tier] += query.getColumn(1).getInt64();
                     }
                 }
             }
-            catch (std::exception& e) {
-                e;
-            }
-        });
 
-        int deleted = GetDatabase(isPermanent)->exec("delete from DataItems where id = '" + id + "'");
-        assert(deleted == 1);
+            for (size_t i = 0, end = configuration.rotatingDataQuotas.size(); i < end; ++i) {
+                const auto& quota = configuration.rotatingDataQuotas[i];
+                const tags_t tags = { { quota.tag, quota.value } };
 
-        fileDeleteOperation.get(); // wait until the file and the empty subdirs (if any) have really been deleted
-    }
+                SQLite::Statement& query = GetStatement(*db, "select coalesce(sum(size), 0) from DataItems where 1 = 1" + GetTagConditions(tags));
+                int index = 0;
+                BindTagConditions(query, index, tags);
 
-    void Storage::Impl::FlushRotating()
-    {
-        Flush(GetDatabase(false));
-    }
+                if (query.executeStep()) {
+                    currentQuotaBytes[i] += query.getColumn(0).getInt64();
+                }
+            }
+        }
 
-    void Storage::Impl::FlushPermanent()
-    {
-        Flush(GetDatabase(true));
+        quotaAndTierBytesNeedRecount = false;
     }
 
-    void Storage::Impl::Flush(std::unique_ptr<SQLite::Database>& db)
+    void Storage::Impl::DeleteRotatingDataExceedingQuotas(const DataItem* dataItems, size_t dataItemCount)
     {
-        db->exec("commit");
-        db->exec("begin exclusive");
-    }
+        if (configuration.rotatingDataQuotas.empty()) {
+            return;
+        }
 
-    std::unique_ptr<SQLite::Database>& Storage::Impl::GetDatabase(bool isPermanent)
-    {
-        return isPermanent ? dbPermanent : dbRotating;
+        if (quotaAndTierBytesNeedRecount) {
+            CountQuotaAndTierBytes(); // some items have been overwritten
+        }
+
+        const auto maxItemsToDelete = std::numeric_limits<unsigned int>::max();
+
+        for (size_t i = 0, end = configuration.rotatingDataQuotas.size(); i < end; ++i) {
+            const auto& quota = configuration.rotatingDataQuotas[i];
+            const tags_t tags = { { quota.tag, quota.value } };
+
+            if (quota.maxDataToKeepInGiB > 0) {
+                const uintmax_t sizeToBeInserted = std::accumulate(dataItems, dataItems + dataItemCount, static_cast<uintmax_t>(0),
+                    [&quota](uintmax_t total, const DataItem& dataItem) {
+                        return total + (!dataItem.isPermanent && MatchesQuota(quota, dataItem.tags) ? dataItem.data.size() : 0);
+                    });
+
+                const auto hasExcessData = [&]() {
+                    return currentQuotaBytes[i] + sizeToBeInserted > quota.maxDataToKeepInGiB * 1024 * 1024 * 1024;
+                };
+
+                DeleteOldestRotatingData(hasExcessData, maxItemsToDelete, tags);
+            }
+
+            if (quota.maxAgeInHours > 0) {
+                const auto maxAge = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::duration<double, std::ratio<3600>>(quota.maxAgeInHours));
+                const auto hasExpiredData = []() { return true; }; // until no more items older than the cutoff
+
+                DeleteOldestRotatingData(hasExpiredData, maxItemsToDelete, tags, ToMicroseconds(now()) - maxAge.count());
+            }
+        }
     }
 
-    std::string Storage::Impl::GetSubDir(bool isPermanent) const
+    bool Storage::Impl::IsAboveEvictionHighWatermark(size_t sizeToBeInserted) const
     {
-        return fs::path(isPermanent ? configuration.permanentDirectory : configuration.rotatingDirectory).string();
+        return currentRotatingDataItemBytes + sizeToBeInserted > configuration.evictionHighWatermark * configuration.maxRotatingDataToKeepInGiB * 1024 * 1024 * 1024
+            || IsFreeDiskSpaceBelow(0.0, configuration.evictionStartFreeDiskPercent, sizeToBeInserted);
     }
 
-    void Storage::Impl::CreateDirectoriesThatDoNotExist()
+    void Storage::Impl::StartEvictionThreadIfNeeded()
     {
-        fs::create_directories(GetSubDir(false));
-        fs::create_directories(GetSubDir(true));
+        if (configuration.useBackgroundEviction || configuration.rotatingTiers.size() > 1) {
+            evictionThread = std::thread(&Storage::Impl::EvictionThreadMain, this);
+        }
     }
 
-    void Storage::Impl::CreateDatabases()
+    void Storage::Impl::WakeUpEvictionThread()
     {
-        dbRotating = std::unique_ptr<SQLite::Database>(new SQLite::Database((fs::path(GetSubDir(false)) / "isto_rotating.sqlite").string(), SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE));
-        dbPermanent = std::unique_ptr<SQLite::Database>(new SQLite::Database((fs::path(GetSubDir(true)) / "isto_permanent.sqlite").string(), SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE));
+        {
+            std::lock_guard<std::mutex> lock(evictionThreadMutex);
+            evictionThreadWakeUpRequested = true;
+        }
 
-        dbRotating->exec("begin exclusive");
-        dbPermanent->exec("begin exclusive");
+        evictionThreadCondition.notify_one();
     }
 
-    void Storage::Impl::CreateIndexesThatDoNotExist()
+    void Storage::Impl::EvictionThreadMain()
     {
-        const std::string createIndexOnTimestamp = "create index if not exists timestamp_index on DataItems(timestamp)";
+        // Check the free disk space every now and then, even if nothing is saved
+        const auto checkInterval = std::chrono::seconds(1);
 
-        dbRotating->exec(createIndexOnTimestamp);
-        dbPermanent->exec(createIndexOnTimestamp);
-    }
+        const auto isStopRequested = [this]() {
+            std::lock_guard<std::mutex> lock(evictionThreadMutex);
+            return evictionThreadStopRequested;
+        };
 
-    void Storage::Impl::CreateTablesThatDoNotExist()
-    {
-        std::ostringstream createTableStatement;
-        createTableStatement << "create table if not exists DataItems (id text primary key, timestamp text, path text, size integer";
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(evictionThreadMutex);
+                evictionThreadCondition.wait_for(lock, checkInterval, [this]() { return evictionThreadStopRequested || evictionThreadWakeUpRequested; });
+                if (evictionThreadStopRequested) {
+                    return;
+                }
+                evictionThreadWakeUpRequested = false;
+            }
 
-        for (const std::string& tag : configuration.tags) {
-            if (tag.find_first_of(" \t\n") != std::string::npos) {
-                throw std::runtime_error("Tag names must not contain whitespace");
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex);
+                CloseIdleRotatingPartitions(configuration.idleRotatingPartitionCloseSeconds);
+                DeleteRotatingDataExceedingQuotas(nullptr, 0); // the max ages, in particular
             }
-            createTableStatement << ", " << tag << " text";
-        }
 
-        createTableStatement << ")";
+            MigrateRotatingDataToLowerTiers(isStopRequested);
 
-        dbRotating->exec(createTableStatement.str());
-        dbPermanent->exec(createTableStatement.str());
-    }
+            if (!configuration.useBackgroundEviction) {
+                continue;
+            }
 
-    void Storage::Impl::CreateStatements()
-    {
-        std::ostringstream insertStatement;
-        insertStatement << "insert or replace into DataItems values (@id, @timestamp, @path, @size";
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex);
+                RefreshRotatingDiskSpaceIfNeeded(0);
+                if (!IsAboveEvictionHighWatermark(0)) {
+                    continue;
+                }
+            }
 
-        for (const std::string& tag : configuration.tags) {
-            insertStatement << ", @" << tag;
-        }
+            // Delete down to the low watermark, one batch at a time, so that the saves can go on in between
+            while (!isStopRequested()) {
+                std::lock_guard<std::recursive_mutex> lock(mutex);
 
-        insertStatement << ")";
+                RefreshRotatingDiskSpaceIfNeeded(0);
 
-        insertRotating = std::unique_ptr<SQLite::Statement>(new SQLite::Statement(*dbRotating, insertStatement.str()));
-        insertPermanent = std::unique_ptr<SQLite::Statement>(new SQLite::Statement(*dbPermanent, insertStatement.str()));
-    }
+                const auto isAboveLowWatermark = [&]() {
+                    return currentRotatingDataItemBytes > configuration.evictionLowWatermark * configuration.maxRotatingDataToKeepInGiB * 1024 * 1024 * 1024
+                        || IsFreeDiskSpaceBelow(0.0, configuration.evictionStopFreeDiskPercent, 0);
+                };
 
-    void Storage::Impl::InitializeCurrentDataItemBytes()
-    {
-        const std::string select = "select sum(size) from DataItems";
-        SQLite::Statement query(*dbRotating, select);
+                const unsigned int batchSize = std::max(configuration.deletionFlushInterval, 1u);
 
-        if (query.executeStep()) {
-            currentRotatingDataItemBytes = query.getColumn(0).getInt64();
-        }
-        else {
-            throw std::runtime_error("Unable to initialize current data item bytes");
+                if (DeleteOldestRotatingData(isAboveLowWatermark, batchSize) < batchSize) {
+                    break; // either below the low watermark, or nothing more to delete
+                }
+            }
         }
     }
 
-    bool Storage::Impl::DeleteExcessRotatingData(size_t sizeToBeInserted)
+    void Storage::Impl::MigrateRotatingDataToLowerTiers(const std::function<bool()>& isStopRequested)
     {
-        auto hardDiskFreeBytes = fs::space(fs::path(configuration.rotatingDirectory)).free;
-
-        const auto hasExcessData = [&]() {
-            return currentRotatingDataItemBytes + sizeToBeInserted > configuration.maxRotatingDataToKeepInGiB * 1024 * 1024 * 1024
-                || hardDiskFreeBytes - sizeToBeInserted < configuration.minFreeDiskSpaceInGiB * 1024 * 1024 * 1024;
-        };
+        const unsigned int batchSize = std::max(configuration.deletionFlushInterval, 1u);
 
-        if (hasExcessData()) {
-            const std::string select = "select id, timestamp, size from DataItems order by timestamp asc";
-            SQLite::Statement query(*dbRotating, select);
-            unsigned int deleteCounter = 0;
+        for (size_t tier = 0; tier + 1 < configuration.rotatingTiers.size(); ++tier) {
+            const auto maxTierBytes = configuration.rotatingTiers[tier].maxDataInGiB * 1024 * 1024 * 1024;
 
-            while (hasExcessData() && query.executeStep()) {
-                const std::string id = query.getColumn(0);
-                const std::string timestampString = query.getColumn(1);
-#if SIZE_MAX > 0xffffffff
-                // 64-bit system
-                const size_t size = query.getColumn(2).getInt64();
-#else
-                // 32-bit system
-                const size_t size = query.getColumn(2);
-#endif
+            while (!isStopRequested()) {
+                struct Migration {
+                    ItemRecord record;
+                    std::string newPath;
+                };
 
-                assert(currentRotatingDataItemBytes >= size);
+                std::vector<Migration> batch;
 
-                const auto timestamp = system_clock_time_point_string_conversion::from_string(timestampString);
+                { // Pick the oldest items of the tier
+                    std::lock_guard<std::recursive_mutex> lock(mutex);
 
-                if (configuration.makeReadOnlyFilesPermanent) {
-                    const auto path = GetPath(false, timestamp, id, configuration.directoryStructureResolution);
-                    const auto permissions = fs::status(path).permissions();
-                    const auto isWritable = (permissions & decltype(permissions)::owner_write) != decltype(permissions)::none;
+                    if (quotaAndTierBytesNeedRecount) {
+                        CountQuotaAndTierBytes();
+                    }
 
-                    if (!isWritable) {
-                        // Make a read-only file permanent
+                    uintmax_t tierBytes = currentTierBytes[tier];
 
-                        if (configuration.permanentDirectory != configuration.rotatingDirectory) {
-                            // We'll have to move the file, so we'll need it to be writable
-                            const auto newPermissions = permissions | fs::perms::owner_write | fs::perms::group_write | fs::perms::others_write;
-                            fs::permissions(path, newPermissions);
+                    for (const auto& db : GetRotatingDatabases()) {
+                        if (tierBytes <= maxTierBytes || batch.size() >= batchSize) {
+                            break;
                         }
 
-                        MakePermanent(id);
+                        SQLite::Statement& query = GetStatement(*db, "select " + GetItemRecordColumns() + " from DataItems where tier = @tier order by timestamp, id limit @limit");
+                        query.bind(1, static_cast<long long>(tier));
+                        query.bind(2, static_cast<long long>(batchSize - batch.size()));
+
+                        while (tierBytes > maxTierBytes && query.executeStep()) {
+                            Migration migration;
+                            migration.record = GetItemRecord(*db, query); // without the dynamic tags, which are not needed here
+
+                            // The same directory structure in the next tier
+                            const auto relativeDirectory = fs::path(GetDirectory(false, migration.record.timestamp, configuration.directoryStructureResolution)).lexically_relative(GetTierDirectory(0));
+                            migration.newPath = (fs::path(GetTierDirectory(tier + 1)) / relativeDirectory / fs::path(migration.record.location.path).filename()).string();
 
-                        if (configuration.permanentDirectory != configuration.rotatingDirectory) {
-                            // Restore the permissions
-                            const auto newPath = GetPath(true, timestamp, id, configuration.directoryStructureResolution);
-                            fs::permissions(newPath, permissions);
+                            tierBytes -= std::min(tierBytes, migration.record.location.size);
+                            batch.push_back(migration);
                         }
 
-                        continue;
+                        query.reset(); // not left reading while the lock is released below
                     }
                 }
 
-                DeleteItem(false, timestamp, id);
+                if (batch.empty()) {
+                    break;
+                }
 
-                currentRotatingDataItemBytes -= size;
-                hardDiskFreeBytes += size;
+                enum class Copy {
+                    Failed,
+                    Created,
+                    LeftOver // a link to the same file, left over by an earlier pass that did not get to update the metadata
+                };
+
+                // Copy the files without holding the lock, so that the saves and the reads can go on
+                std::vector<std::future<Copy>> copyOperations;
+                for (const Migration& migration : batch) {
+                    const fs::path source = migration.record.location.path;
+                    const fs::path destination = migration.newPath;
+                    copyOperations.push_back(ioThreadPool.Run([source, destination]() {
+                        std::error_code error;
+
+                        // Never overwrite (let alone later delete) a file that this pass did not create:
+                        // it may even be the very file that is being migrated
+                        if (fs::exists(destination, error) || error) {
+                            const bool isLeftOver = !error && source.lexically_normal() != destination.lexically_normal() && fs::equivalent(source, destination, error) && !error;
+                            return isLeftOver ? Copy::LeftOver : Copy::Failed;
+                        }
 
-                if (rotatingDataDeletedCallback != nullptr) {
-                    rotatingDataDeletedCallback(id);
+                        fs::create_directories(destination.parent_path(), error);
+                        fs::create_hard_link(source, destination, error); // if on the same volume
+                        if (error) {
+                            fs::copy_file(source, destination, error);
+                            if (error) {
+                                std::error_code ignored;
+                                fs::remove(destination, ignored); // a partial copy, if any
+                                return Copy::Failed;
+                            }
+                        }
+                        return Copy::Created;
+                    }));
                 }
 
-                if (++deleteCounter >= configuration.deletionFlushInterval) {
+                std::vector<fs::path> obsoletePaths;
+
+                { // Point the metadata to the new files
+                    std::lock_guard<std::recursive_mutex> lock(mutex);
+
+                    for (size_t i = 0, end = batch.size(); i < end; ++i) {
+                        const Migration& migration = batch[i];
+                        const Copy copy = copyOperations[i].get();
+                        if (copy == Copy::Failed) {
+                            continue;
+                        }
+
+                        // NB: the item may have been deleted, or moved, in the meantime - even its partition may be gone
+                        auto* db = FindRotatingDatabase(ToMicroseconds(migration.record.timestamp));
+                        if (!db) {
+                            if (copy == Copy::Created) {
+                                obsoletePaths.push_back(migration.newPath);
+                            }
+                            continue;
+                        }
+
+                        SQLite::Statement& update = GetStatement(*db, "update DataItems set path = @new_path, tier = @new_tier where id = @id and path = @path");
+                        update.bind(1, migration.newPath);
+                        update.bind(2, static_cast<long long>(tier + 1));
+                        update.bind(3, migration.record.id);
+                        update.bind(4, migration.record.location.path);
+
+                        if (update.exec() == 1) {
+                            currentTierBytes[tier] -= std::min(currentTierBytes[tier], migration.record.location.size);
+                            currentTierBytes[tier + 1] += migration.record.location.size;
+                            obsoletePaths.push_back(migration.record.location.path);
+                        }
+                        else if (copy == Copy::Created) {
+                            obsoletePaths.push_back(migration.newPath);
+                        }
+                    }
+
                     FlushRotating();
-                    deleteCounter = 0;
                 }
-            }
 
-            if (deleteCounter > 0) {
-                FlushRotating();
+                for (const fs::path& path : obsoletePaths) {
+                    RemoveFileAndEmptyParentDirectories(path);
+                }
+
+                if (batch.size() < batchSize) {
+                    break;
+                }
             }
         }
+    }
 
-        return !hasExcessData();
+    void Storage::Impl::StopEvictionThread()
+    {
+        {
+            std::lock_guard<std::mutex> lock(evictionThreadMutex);
+            evictionThreadStopRequested = true;
+        }
+
+        evictionThreadCondition.notify_all();
+
+        if (evictionThread.joinable()) {
+            evictionThread.join();
+        }
     }
 
-    std::deque<std::string> Storage::Impl::GetIdsSortedByAscendingTimestamp(const std::string& timestampBegin, const std::string& timestampEnd) const
+    std::deque<std::string> Storage::Impl::GetIdsSortedByAscendingTimestamp(const std::string& timestampBegin, const std::string& timestampEnd)
     {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+
         std::deque<std::string> ids;
 
         std::ostringstream select;
@@ -820,25 +3558,40 @@ namespace isto {
 
         if (!timestampBegin.empty()) {
             addWhereOrAnd();
-            select << " timestamp >= '" + timestampBegin + "'";
+            select << " timestamp >= @timestamp_begin";
         }
         if (!timestampEnd.empty()) {
             addWhereOrAnd();
-            select << " timestamp < '" + timestampEnd + "'";
+            select << " timestamp < @timestamp_end";
         }
 
         select << " order by timestamp asc";
 
-        SQLite::Statement query(*dbRotating, select.str());
-        while (query.executeStep()) {
-            const std::string id = query.getColumn(0);
-            ids.push_back(id);
+        const int64_t begin = timestampBegin.empty() ? std::numeric_limits<int64_t>::min() : ToMicroseconds(system_clock_time_point_string_conversion::from_string(timestampBegin));
+        const int64_t end = timestampEnd.empty() ? std::numeric_limits<int64_t>::max() : ToMicroseconds(system_clock_time_point_string_conversion::from_string(timestampEnd));
+
+        // The partitions do not overlap, so the results of each can simply be appended
+        for (const auto& db : GetRotatingDatabases(begin, end)) {
+            SQLite::Statement& query = GetStatement(*db, select.str());
+
+            int index = 0;
+            if (!timestampBegin.empty()) {
+                query.bind(++index, begin);
+            }
+            if (!timestampEnd.empty()) {
+                query.bind(++index, end);
+            }
+            while (query.executeStep()) {
+                const std::string id = query.getColumn(0);
+                ids.push_back(id);
+            }
         }
         return ids;
     }
 
     void Storage::Impl::SetRotatingDataDeletedCallback(const rotating_data_deleted_callback_t& callback)
     {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
         rotatingDataDeletedCallback = callback;
     }
 
@@ -4,80 +4,400 @@
 //    (See accompanying file LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 
+#ifndef ISTO_IMPL_H
+#define ISTO_IMPL_H
+
 #include "isto.h"
+#include "thread_pool.h"
+#include "segment_file.h"
+#include "memory_mapped_file.h"
+#include "hot_item_cache.h"
+#include "connection_pool.h"
 #include <SQLiteCpp/Database.h>
 #include <SQLiteCpp/Statement.h>
 #include <memory>
 #include <future>
+#include <unordered_map>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <filesystem>
+#include <limits>
 
 namespace isto {
     
     class Storage::Impl {
     public:
         Impl(const Configuration& configuration);
+        ~Impl();
 
         bool SaveData(const DataItem& dataItem, bool upsert);
         bool SaveData(const DataItems& dataItems, bool upsert);
 
+        std::future<bool> SaveDataAsync(const DataItem& dataItem, bool upsert);
+
         DataItem GetData(const std::string& id);
         DataItem GetPermanentData(const std::string& id);
         DataItem GetRotatingData(const std::string& id);
+
+        DataItem GetDataView(const std::string& id);
         
         DataItem GetData(const timestamp_t& timestamp, const std::string& comparisonOperator, const tags_t& tags);
         DataItems GetDataItems(const timestamp_t& startTime, const timestamp_t& endTime, const tags_t& tags, size_t maxItems, Order order);
 
+        DataItemMetadataItems GetMetadataItems(const timestamp_t& startTime, const timestamp_t& endTime, const tags_t& tags, size_t maxItems, Order order);
+        DataItem GetData(const DataItemMetadata& metadata);
+
+        struct IdAndTimestamp {
+            std::string id;
+            int64_t timestamp; // microseconds since the epoch
+        };
+
+        // Returns the next page of matching ids, ordered by timestamp (and id), that come after the given item (if any)
+        std::deque<IdAndTimestamp> GetIdsAndTimestamps(
+            bool isPermanent,
+            const timestamp_t& startTime,
+            const timestamp_t& endTime,
+            const tags_t& tags,
+            bool descending,
+            const IdAndTimestamp* after,
+            size_t maxItems);
+
+        // Reads the payload using the I/O threads
+        // - the timestamp tells the partition to read from, so that the partitions need not be searched for the id
+        std::future<std::unique_ptr<DataItem>> GetDataAsync(bool isPermanent, const IdAndTimestamp& item);
+
         bool MakePermanent(const std::string& id);
+        size_t MakePermanent(const std::vector<std::string>& ids);
+
+        bool Pin(const std::string& id);
         bool MakeRotating(const std::string& id);
 
-        std::deque<std::string> GetIdsSortedByAscendingTimestamp(const std::string& timestampBegin, const std::string& timestampEnd) const;
+        std::deque<std::string> GetIdsSortedByAscendingTimestamp(const std::string& timestampBegin, const std::string& timestampEnd);
+
+        void Flush();
 
         void SetRotatingDataDeletedCallback(const rotating_data_deleted_callback_t& callback);
 
     private:
+        // Where the payload of a data item is stored
+        struct ItemLocation {
+            std::string path; // either a file of its own, or a segment file
+            int64_t segmentOffset = -1; // -1 if the payload is in a file of its own
+            uintmax_t size = 0;
+
+            bool IsInSegmentFile() const { return segmentOffset >= 0; }
+        };
+
         bool SaveData(const DataItem* dataItems, size_t dataItemCount, bool upsert);
-        void InsertDataItem(const DataItem& dataItem);
+        bool SaveDataToSegmentFiles(const DataItem* dataItems, size_t dataItemCount, bool upsert);
+        void InsertDataItem(const DataItem& dataItem, const ItemLocation& location, bool upsert);
+
+        std::unique_ptr<ItemLocation> GetItemLocation(std::unique_ptr<SQLite::Database>& db, const std::string& id);
+
+        // The metadata of a data item, as stored in the database
+        struct ItemRecord {
+            std::string id;
+            timestamp_t timestamp;
+            ItemLocation location;
+            tags_t tags;
+            bool isPermanent = false;
+            unsigned int tier = 0; // see Configuration::rotatingTiers
+        };
+
+        std::string GetItemRecordColumns() const;
+        std::string GetTagConditions(const tags_t& tags) const; // to be appended to a where clause
+        void BindTagConditions(SQLite::Statement& query, int& index, const tags_t& tags) const;
+        void ReadDynamicTags(const std::unique_ptr<SQLite::Database>& db, ItemRecord* records, size_t recordCount) const; // a batch at a time
+        void InsertDynamicTags(std::unique_ptr<SQLite::Database>& db, const std::string& item, const tags_t& tags);
+        ItemRecord GetItemRecord(const std::unique_ptr<SQLite::Database>& db, SQLite::Statement& query) const; // reads the GetItemRecordColumns() of the current row, but not the dynamic tags
+        std::unique_ptr<ItemRecord> GetItemRecord(std::unique_ptr<SQLite::Database>& db, const std::string& id);
+        std::vector<ItemRecord> GetItemRecords(std::unique_ptr<SQLite::Database>& db, const timestamp_t& startTime, const timestamp_t& endTime, const tags_t& tags, size_t maxItems, Order order);
+        std::vector<ItemRecord> GetRotatingItemRecords(const timestamp_t& startTime, const timestamp_t& endTime, const tags_t& tags, size_t maxItems, Order order);
 
         std::unique_ptr<SQLite::Database>& GetDatabase(bool isPermanent);
+        std::unique_ptr<SQLite::Database>& GetDatabase(bool isPermanent, const std::string& id); // the partition that has the item, if partitioned
+        std::unique_ptr<SQLite::Database>& GetDatabase(bool isPermanent, int64_t timestamp); // the partition of the timestamp, if partitioned
+        bool IsPermanentDatabase(const std::unique_ptr<SQLite::Database>& db) const; // either the write connection or a read connection
+
+        // The database to read from: a connection leased from the pool (see Configuration::readConnectionCount),
+        // or else the write connection - in which case the caller must hold the mutex (see LockForReading)
+        class ReadConnection {
+        public:
+            ReadConnection(Impl& impl, bool isPermanent);
+            ReadConnection(Impl& impl, bool isPermanent, const std::string& id);
+            ReadConnection(Impl& impl, bool isPermanent, int64_t timestamp);
+            ~ReadConnection();
+
+            std::unique_ptr<SQLite::Database>& operator*() const { return db; }
+
+        private:
+            Impl& impl;
+            ConnectionPool* pool;
+            std::unique_ptr<SQLite::Database>& db;
+        };
+
+        // Locks the mutex, unless the reads go through the connection pools
+        // - in read-only mode, also catches up with the partitions of the writer (see RefreshReadOnlyRotatingPartitions)
+        std::unique_lock<std::recursive_mutex> LockForReading();
+
+        // Returns a statement that is prepared only once per database and SQL text, reset and ready to be bound
+        // - NB: the statement is shared, so it must not be reused while its results are still being read
+        SQLite::Statement& GetStatement(const std::unique_ptr<SQLite::Database>& db, const std::string& sql) const;
+        void ResetStatements(const std::unique_ptr<SQLite::Database>& db) const; // ends the read transaction of the connection, if any
+        DataItem GetDataUsingCache(bool isPermanent, const std::string& id);
+        DataItem GetDataUsingCache(const ItemRecord& record);
         std::future<std::unique_ptr<DataItem>> GetData(std::unique_ptr<SQLite::Database>& db, const std::string& id, std::launch preferredLaunchMode);
-        DataItems GetDataItems(std::unique_ptr<SQLite::Database>& db, const timestamp_t& startTime, const timestamp_t& endTime, const tags_t& tags, size_t maxItems, Order order);
+        std::future<std::unique_ptr<DataItem>> GetData(const ItemRecord& record, std::launch preferredLaunchMode);
+        DataItems GetDataItems(const std::vector<ItemRecord>& records);
 
         std::string GetSubDir(bool isPermanent) const;
         std::string GetDirectory(bool isPermanent, const timestamp_t& timestamp, Configuration::DirectoryStructureResolution resolution) const;
+        std::string GetDirectory(const std::string& rootDirectory, const timestamp_t& timestamp, Configuration::DirectoryStructureResolution resolution) const;
         std::string GetPath(bool isPermanent, const timestamp_t& timestamp, const std::string& id, Configuration::DirectoryStructureResolution resolution) const;
 
         void CreateDirectoriesThatDoNotExist();
         void CreateDatabases();
-        void CreateTablesThatDoNotExist();
-        void CreateIndexesThatDoNotExist();
+        void CreateConnectionPoolsIfNeeded();
+        void OpenDatabasesReadOnly(); // see Configuration::readOnly
+        void ThrowIfReadOnly() const;
+        void CreateTablesThatDoNotExist(const std::vector<std::unique_ptr<SQLite::Database>*>& dbs);
+        void AddColumnsThatDoNotExist(const std::vector<std::unique_ptr<SQLite::Database>*>& dbs);
+        void ConvertTextTimestampsToIntegers();
+        void CreateIndexesThatDoNotExist(const std::vector<std::unique_ptr<SQLite::Database>*>& dbs);
+        std::string GetInsertStatement() const;
         void CreateStatements();
         void InitializeCurrentDataItemBytes();
+        void PinReadOnlyFilesIfNeeded(); // see Configuration::makeReadOnlyFilesPermanent
+
+        struct RotatingVolume;
+
+        // The metadata of the rotating data in a time range (see Configuration::rotatingMetadataPartitioning)
+        struct RotatingPartition {
+            int64_t begin = 0; // microseconds since the epoch, inclusive
+            int64_t end = 0; // exclusive
+            std::string path;
+            std::unique_ptr<SQLite::Database> db; // null while closed (see GetRotatingPartitionDatabase)
+            std::unique_ptr<SQLite::Statement> insert; // declared after the database, so that it is finalized first
+            int committedChanges = 0; // see FlushRotating
+            std::chrono::steady_clock::time_point lastUsed;
+
+            // The totals of the items, counted when first needed and then kept up to date (see CountRotatingPartition)
+            bool isCounted = false;
+            uintmax_t bytes = 0;
+            std::map<RotatingVolume*, uintmax_t> fileBytes; // of the items that are not in segment files, by volume
+            size_t pinnedItems = 0;
+        };
+
+        bool IsRotatingMetadataPartitioned() const;
+        std::vector<std::unique_ptr<SQLite::Database>*> GetAllDatabases();
+
+        // A rotating database that is opened only when dereferenced, so that a loop that stops early does not open the rest
+        class RotatingDatabase {
+        public:
+            RotatingDatabase(Impl& impl, RotatingPartition* partition) : impl(&impl), partition(partition) {}
+
+            std::unique_ptr<SQLite::Database>& operator*() const;
+
+        private:
+            Impl* impl;
+            RotatingPartition* partition; // nullptr for dbRotating
+        };
+
+        // The rotating databases that overlap the time range (in microseconds, inclusive), oldest first unless descending
+        // - just dbRotating, unless partitioned
+        std::vector<RotatingDatabase> GetRotatingDatabases(
+            int64_t begin = std::numeric_limits<int64_t>::min(), int64_t end = std::numeric_limits<int64_t>::max(), bool descending = false);
+
+        std::unique_ptr<SQLite::Database>* FindRotatingDatabase(int64_t timestamp); // nullptr if there's no such partition
+        RotatingPartition* FindRotatingPartition(int64_t timestamp); // nullptr if there's no such partition
+        RotatingPartition& GetRotatingPartition(int64_t timestamp); // created if needed, and opened
+        std::string GetRotatingPartitionPath(int64_t begin, bool isHourly) const;
+        void AddRotatingPartition(const std::string& path, int64_t begin, int64_t end); // not opened yet
+        void AddExistingRotatingPartitions();
+        void RefreshReadOnlyRotatingPartitions(); // finds the partitions that the writer has created or dropped since
+        std::unique_ptr<SQLite::Database>& GetRotatingPartitionDatabase(RotatingPartition& partition); // opened if needed
+        void CloseRotatingPartition(RotatingPartition& partition, bool commit);
+
+        // NB: only where no databases are being referred to, as the partitions may be closed
+        void CloseIdleRotatingPartitions(double maxIdleSeconds);
+
+        // Counts the items of the partition, unless already counted; from then on, every change to its items is counted too
+        void CountRotatingPartition(RotatingPartition& partition);
+        RotatingPartition* FindCountedRotatingPartition(const std::unique_ptr<SQLite::Database>& db); // nullptr if none
+        void CountRotatingItem(RotatingPartition& partition, const std::string& path, uintmax_t size, bool isInSegmentFile, bool isPinned, bool add);
+
+        void MoveUnpartitionedRotatingItems();
+        void DropRotatingPartition(int64_t begin);
+
+        // Drops the oldest partition, if all of its items would be deleted one by one anyway
+        bool DropOldestRotatingPartitionIfExcess(const std::function<bool()>& hasExcessData, const tags_t& tags, int64_t endTime, unsigned int& deleteCounter);
 
         // returns true if ok to save
         bool DeleteExcessRotatingData(size_t sizeToBeInserted);
 
+        // Deletes the oldest rotating data for as long as there is excess data, returns the number of items deleted
+        // - optionally only the items having the given tags, and older than the given end time (in microseconds)
+        unsigned int DeleteOldestRotatingData(const std::function<bool()>& hasExcessData, unsigned int maxItemsToDelete,
+            const tags_t& tags = tags_t(), int64_t endTime = std::numeric_limits<int64_t>::max());
+
+        // See Configuration::rotatingDataQuotas
+        void DeleteRotatingDataExceedingQuotas(const DataItem* dataItems, size_t dataItemCount);
+        void AddQuotaAndTierBytes(const tags_t& tags, unsigned int tier, uintmax_t size);
+        void SubtractQuotaAndTierBytes(const tags_t& tags, unsigned int tier, uintmax_t size);
+        void CountQuotaAndTierBytes();
+
+        // See Configuration::rotatingTiers
+        std::string GetTierDirectory(size_t tier) const;
+        unsigned int GetTier(const std::string& path) const; // of a rotating item, by the directory it is in
+        void MigrateRotatingDataToLowerTiers(const std::function<bool()>& isStopRequested);
+
+        // Deletes the files of the given (already deleted) rotating items, a whole directory at a time if possible
+        void DeletePayloads(const std::vector<ItemRecord>& deletedRotatingItems);
+        void FinishDeletingRotatingData(const std::vector<ItemRecord>& deletedRotatingItems); // the payloads, the counters, and the callback
+        bool IsWholeBucketDeleted(const std::string& directory, const timestamp_t& timestamp, const std::string& rootDirectory);
+        uintmax_t GetFreedDiskSpace(const ItemRecord& deletedRotatingItem) const; // when the item is deleted, to be added to the estimated free space
+        std::string GetRootDirectory(const ItemRecord& rotatingItem); // the tier, the stripe, or just the rotating directory
+
+        // A volume that the rotating data is stored on, and its estimated free space (see Configuration::freeDiskSpaceCheckIntervalSeconds)
+        struct RotatingVolume {
+            std::string directory;
+            std::filesystem::space_info space = {};
+            std::chrono::steady_clock::time_point checkedAt;
+        };
+
+        void CreateRotatingVolumes(); // see Configuration::rotatingStripes
+        RotatingVolume& GetRotatingVolume(const std::string& path);
+        std::string ChooseRotatingRootDirectory(); // for a new rotating item
+        void RefreshRotatingDiskSpaceIfNeeded(size_t sizeToBeInserted);
+        bool IsFreeDiskSpaceBelow(double bytes, double percent, size_t sizeToBeInserted) const; // on any of the volumes
+
+        bool IsAboveEvictionHighWatermark(size_t sizeToBeInserted) const;
+
         bool MoveDataItem(bool sourceIsPermanent, bool destinationIsPermanent, const std::string& id);
-        void DeleteItem(bool isPermanent, const timestamp_t& timestamp, const std::string& id);
+        size_t MoveDataItems(bool sourceIsPermanent, bool destinationIsPermanent, const std::vector<std::string>& ids); // returns the number of items moved
+        void DeleteItem(bool isPermanent, const std::string& id, const ItemLocation& location);
+        bool IsSegmentReferenced(const std::string& path);
+        int DeleteMetadata(std::unique_ptr<SQLite::Database>& db, const std::string& id);
+
+        struct ActiveSegment {
+            std::string directory;
+            unsigned int index = 0;
+            uintmax_t size = 0; // the used size, i.e. where the next payload is appended
+            std::shared_ptr<SegmentFile> file;
+        };
+
+        ActiveSegment& GetActiveSegment(bool isPermanent);
+        std::string GetSegmentPath(bool isPermanent, const std::string& directory, unsigned int index) const;
+        ItemLocation AllocateSegmentSpace(bool isPermanent, const std::string& directory, uintmax_t size);
+        void OpenActiveSegment(bool isPermanent, const std::string& directory, unsigned int minIndex);
+        void RetireSegment(ActiveSegment& segment);
+        bool IsActiveSegment(const std::string& path);
 
         void FlushRotating();
         void FlushPermanent();
         void Flush(std::unique_ptr<SQLite::Database>& db);
 
-        std::pair<std::string, std::unique_ptr<SQLite::Database>&> FindMatchingTimestampAndCorrespondingDatabase(
-            const std::chrono::system_clock::time_point& timestamp,
-            const std::string& comparisonOperator,
-            const tags_t& tags);
+        struct UncommittedChanges {
+            unsigned int items = 0;
+            uintmax_t bytes = 0;
+            std::chrono::steady_clock::time_point since;
+        };
+
+        UncommittedChanges& GetUncommittedChanges(bool isPermanent);
+        void FlushIfCommitIntervalReached(bool isPermanent);
+
+        // Returns the items matching the comparison that are nearest to the timestamp (in microseconds)
+        // - "~" yields up to two items: the nearest previous and the nearest next one
+        std::vector<ItemRecord> GetItemRecordsNearestTo(std::unique_ptr<SQLite::Database>& db, int64_t timestamp, const std::string& comparisonOperator, const tags_t& tags);
+        std::vector<ItemRecord> GetRotatingItemRecordsNearestTo(int64_t timestamp, const std::string& comparisonOperator, const tags_t& tags);
+
+        void StartAsyncSaveThreadIfNotRunning();
+        void AsyncSaveThreadMain();
+        void StopAsyncSaveThread();
+
+        void StartCommitThreadIfNeeded();
+        void CommitThreadMain();
+        void StopCommitThread();
+
+        void StartEvictionThreadIfNeeded();
+        void WakeUpEvictionThread();
+        void EvictionThreadMain();
+        void StopEvictionThread();
 
         Configuration configuration;
+        ThreadPool ioThreadPool;
+        HotItemCache hotItemCache;
+
         std::unique_ptr<SQLite::Database> dbRotating;
         std::unique_ptr<SQLite::Database> dbPermanent;
-        std::unique_ptr<SQLite::Database> dbNone;
 
         std::unique_ptr<SQLite::Statement> insertRotating;
         std::unique_ptr<SQLite::Statement> insertPermanent;
 
+        std::map<int64_t, RotatingPartition> rotatingPartitions; // by begin; see Configuration::rotatingMetadataPartitioning
+        std::chrono::steady_clock::time_point rotatingPartitionsScannedAt; // see RefreshReadOnlyRotatingPartitions
+
+        // See Configuration::readConnectionCount
+        std::unique_ptr<ConnectionPool> rotatingConnectionPool;
+        std::unique_ptr<ConnectionPool> permanentConnectionPool;
+
+        // See GetStatement - declared after the databases and the pools, so that the statements are finalized first
+        typedef std::unordered_map<std::string, std::unique_ptr<SQLite::Statement>> statements_t;
+        mutable std::unordered_map<const SQLite::Database*, statements_t> statements;
+        mutable std::mutex statementsMutex;
+
         uintmax_t currentRotatingDataItemBytes = -1;
 
+        std::vector<uintmax_t> currentQuotaBytes; // one for each Configuration::rotatingDataQuotas
+        std::vector<uintmax_t> currentTierBytes; // one for each Configuration::rotatingTiers
+        bool quotaAndTierBytesNeedRecount = false;
+
+        std::vector<RotatingVolume> rotatingVolumes;
+        size_t nextStripe = 0; // see Configuration::StripingPolicy::RoundRobin
+
+        UncommittedChanges uncommittedRotating;
+        UncommittedChanges uncommittedPermanent;
+
+        ActiveSegment activeRotatingSegment;
+        ActiveSegment activePermanentSegment;
+
         rotating_data_deleted_callback_t rotatingDataDeletedCallback;
+
+        // Serializes the access to the databases and the files, between the caller and the writer thread
+        mutable std::recursive_mutex mutex;
+
+        struct AsyncSaveRequest {
+            AsyncSaveRequest(const DataItem& dataItem, bool upsert) : dataItem(dataItem), upsert(upsert) {}
+
+            const DataItem dataItem;
+            const bool upsert;
+            std::promise<bool> saved;
+        };
+
+        std::deque<std::unique_ptr<AsyncSaveRequest>> asyncSaveQueue;
+        std::mutex asyncSaveQueueMutex;
+        std::condition_variable asyncSaveQueueNotEmpty;
+        std::condition_variable asyncSaveQueueNotFull;
+        std::thread asyncSaveThread;
+        bool asyncSaveThreadStopRequested = false;
+
+        // Commits the metadata when Configuration::commitIntervalMilliseconds has elapsed, even if no more items are saved
+        std::thread commitThread;
+        std::mutex commitThreadMutex;
+        std::condition_variable commitThreadCondition;
+        bool commitThreadStopRequested = false;
+
+        // Deletes rotating data (see Configuration::useBackgroundEviction), and moves it down the tiers (see Configuration::rotatingTiers), in the background
+        std::thread evictionThread;
+        std::mutex evictionThreadMutex;
+        std::condition_variable evictionThreadCondition;
+        bool evictionThreadWakeUpRequested = false;
+        bool evictionThreadStopRequested = false;
     };
 
 };
+
+#endif // ISTO_IMPL_H
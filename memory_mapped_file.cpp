@@ -0,0 +1,89 @@
+//               Copyright 2017 Juha Reunanen
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "memory_mapped_file.h"
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else // _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif // _WIN32
+
+namespace isto {
+
+#ifdef _WIN32
+
+    MemoryMappedFile::MemoryMappedFile(const std::string& path, uintmax_t offset, size_t size)
+        : size_(size)
+    {
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo(&systemInfo);
+
+        const uintmax_t alignedOffset = offset - offset % systemInfo.dwAllocationGranularity;
+        alignmentOffset = static_cast<size_t>(offset - alignedOffset);
+
+        const HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Unable to open " + path + ", error " + std::to_string(GetLastError()));
+        }
+
+        const HANDLE fileMapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(file); // the mapping keeps the file open
+
+        if (fileMapping == nullptr) {
+            throw std::runtime_error("Unable to map " + path + ", error " + std::to_string(GetLastError()));
+        }
+
+        mapping = MapViewOfFile(fileMapping, FILE_MAP_READ, static_cast<DWORD>(alignedOffset >> 32), static_cast<DWORD>(alignedOffset & 0xffffffff), alignmentOffset + size);
+        CloseHandle(fileMapping); // the view keeps the mapping alive
+
+        if (mapping == nullptr) {
+            throw std::runtime_error("Unable to map a view of " + path + ", error " + std::to_string(GetLastError()));
+        }
+    }
+
+    MemoryMappedFile::~MemoryMappedFile()
+    {
+        UnmapViewOfFile(mapping);
+    }
+
+#else // _WIN32
+
+    MemoryMappedFile::MemoryMappedFile(const std::string& path, uintmax_t offset, size_t size)
+        : size_(size)
+    {
+        const uintmax_t pageSize = static_cast<uintmax_t>(sysconf(_SC_PAGESIZE));
+        const uintmax_t alignedOffset = offset - offset % pageSize;
+        alignmentOffset = static_cast<size_t>(offset - alignedOffset);
+
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("Unable to open " + path + ": " + strerror(errno));
+        }
+
+        mapping = mmap(nullptr, alignmentOffset + size, PROT_READ, MAP_SHARED, fd, static_cast<off_t>(alignedOffset));
+        close(fd); // the mapping keeps the file open
+
+        if (mapping == MAP_FAILED) {
+            mapping = nullptr;
+            throw std::runtime_error("Unable to map " + path + ": " + strerror(errno));
+        }
+    }
+
+    MemoryMappedFile::~MemoryMappedFile()
+    {
+        munmap(mapping, alignmentOffset + size_);
+    }
+
+#endif // _WIN32
+
+}
@@ -0,0 +1,35 @@
+//               Copyright 2017 Juha Reunanen
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef ISTO_MEMORY_MAPPED_FILE_H
+#define ISTO_MEMORY_MAPPED_FILE_H
+
+#include <string>
+#include <cstdint>
+
+namespace isto {
+
+    // A read-only mapping of a range of a file
+    class MemoryMappedFile {
+    public:
+        MemoryMappedFile(const std::string& path, uintmax_t offset, size_t size);
+        ~MemoryMappedFile();
+
+        MemoryMappedFile(const MemoryMappedFile&) = delete;
+        MemoryMappedFile& operator=(const MemoryMappedFile&) = delete;
+
+        const unsigned char* data() const { return static_cast<const unsigned char*>(mapping) + alignmentOffset; }
+        size_t size() const { return size_; }
+
+    private:
+        void* mapping = nullptr;
+        size_t alignmentOffset = 0; // the mapping has to start at a page boundary
+        size_t size_ = 0;
+    };
+
+};
+
+#endif // ISTO_MEMORY_MAPPED_FILE_H
@@ -0,0 +1,91 @@
+//               Copyright 2017 Juha Reunanen
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "query_impl.h"
+#include <algorithm> // std::max
+
+namespace isto {
+
+    namespace {
+        const size_t idsPerPage = 100;
+    }
+
+    Storage::Query::Impl::Impl(Storage::Impl& storage, const timestamp_t& startTime, const timestamp_t& endTime, const tags_t& tags, Order order, size_t readAheadItems)
+        : storage(storage)
+        , startTime(startTime)
+        , endTime(endTime)
+        , tags(tags)
+        , descending(order == Order::Descending)
+        , readAheadItems(std::max(readAheadItems, static_cast<size_t>(1)))
+    {
+        rotating.isPermanent = false;
+        permanent.isPermanent = true;
+    }
+
+    DataItem Storage::Query::Impl::Next()
+    {
+        while (true) {
+            while (pendingReads.size() < readAheadItems && StartNextRead())
+                ;
+
+            if (pendingReads.empty()) {
+                return DataItem::Invalid();
+            }
+
+            std::unique_ptr<DataItem> dataItem = pendingReads.front().get();
+            pendingReads.pop_front();
+
+            if (dataItem->isValid) {
+                return *dataItem; // NB: copying a data item does not copy the payload
+            }
+            // else the item was deleted after its id was fetched - just skip it
+        }
+    }
+
+    const Storage::Impl::IdAndTimestamp* Storage::Query::Impl::PeekNextId(Source& source)
+    {
+        if (source.page.empty() && !source.exhausted) {
+            source.page = storage.GetIdsAndTimestamps(source.isPermanent, startTime, endTime, tags, descending, source.last.get(), idsPerPage);
+            if (source.page.size() < idsPerPage) {
+                source.exhausted = true;
+            }
+            if (!source.page.empty()) {
+                source.last = std::make_unique<Storage::Impl::IdAndTimestamp>(source.page.back());
+            }
+        }
+
+        return source.page.empty() ? nullptr : &source.page.front();
+    }
+
+    bool Storage::Query::Impl::StartNextRead()
+    {
+        const auto* nextRotating = PeekNextId(rotating);
+        const auto* nextPermanent = PeekNextId(permanent);
+
+        Source* source = nullptr;
+
+        if (nextRotating && nextPermanent) {
+            const bool rotatingFirst = descending
+                ? nextRotating->timestamp >= nextPermanent->timestamp
+                : nextRotating->timestamp <= nextPermanent->timestamp;
+            source = rotatingFirst ? &rotating : &permanent;
+        }
+        else if (nextRotating) {
+            source = &rotating;
+        }
+        else if (nextPermanent) {
+            source = &permanent;
+        }
+        else {
+            return false;
+        }
+
+        pendingReads.push_back(storage.GetDataAsync(source->isPermanent, source->page.front()));
+        source->page.pop_front();
+        return true;
+    }
+
+};
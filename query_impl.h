@@ -0,0 +1,48 @@
+//               Copyright 2017 Juha Reunanen
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef ISTO_QUERY_IMPL_H
+#define ISTO_QUERY_IMPL_H
+
+#include "isto_impl.h"
+
+namespace isto {
+
+    class Storage::Query::Impl {
+    public:
+        Impl(Storage::Impl& storage, const timestamp_t& startTime, const timestamp_t& endTime, const tags_t& tags, Order order, size_t readAheadItems);
+
+        DataItem Next();
+
+    private:
+        // The ids are fetched from each database a page at a time, and the pages are merged by timestamp
+        struct Source {
+            bool isPermanent = false;
+            std::deque<Storage::Impl::IdAndTimestamp> page;
+            std::unique_ptr<Storage::Impl::IdAndTimestamp> last; // the last id fetched so far, if any
+            bool exhausted = false;
+        };
+
+        const Storage::Impl::IdAndTimestamp* PeekNextId(Source& source);
+        bool StartNextRead();
+
+        Storage::Impl& storage;
+
+        const timestamp_t startTime;
+        const timestamp_t endTime;
+        const tags_t tags;
+        const bool descending;
+        const size_t readAheadItems;
+
+        Source rotating;
+        Source permanent;
+
+        std::deque<std::future<std::unique_ptr<DataItem>>> pendingReads;
+    };
+
+};
+
+#endif // ISTO_QUERY_IMPL_H
@@ -0,0 +1,171 @@
+//               Copyright 2017 Juha Reunanen
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "segment_file.h"
+#include <stdexcept>
+#include <algorithm> // std::min
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else // _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif // _WIN32
+
+namespace isto {
+
+#ifdef _WIN32
+
+    SegmentFile::SegmentFile(const std::string& path, bool writable)
+        : path(path)
+    {
+        handle = CreateFileA(path.c_str(),
+            writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr,
+            writable ? OPEN_ALWAYS : OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr);
+
+        if (handle == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Unable to open segment file " + path + ", error " + std::to_string(GetLastError()));
+        }
+    }
+
+    SegmentFile::~SegmentFile()
+    {
+        CloseHandle(handle);
+    }
+
+    void SegmentFile::Preallocate(uintmax_t size)
+    {
+        FILE_ALLOCATION_INFO allocationInfo;
+        allocationInfo.AllocationSize.QuadPart = static_cast<LONGLONG>(size);
+        SetFileInformationByHandle(handle, FileAllocationInfo, &allocationInfo, sizeof(allocationInfo)); // just a hint
+    }
+
+    void SegmentFile::Truncate(uintmax_t size)
+    {
+        FILE_END_OF_FILE_INFO endOfFileInfo;
+        endOfFileInfo.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+        if (!SetFileInformationByHandle(handle, FileEndOfFileInfo, &endOfFileInfo, sizeof(endOfFileInfo))) {
+            throw std::runtime_error("Unable to truncate segment file " + path + ", error " + std::to_string(GetLastError()));
+        }
+    }
+
+    void SegmentFile::Write(uintmax_t offset, const unsigned char* data, size_t size)
+    {
+        while (size > 0) {
+            OVERLAPPED overlapped = {};
+            overlapped.Offset = static_cast<DWORD>(offset & 0xffffffff);
+            overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+            DWORD written = 0;
+            const DWORD toWrite = static_cast<DWORD>(std::min(size, static_cast<size_t>(1 << 30)));
+            if (!WriteFile(handle, data, toWrite, &written, &overlapped)) {
+                throw std::runtime_error("Unable to write segment file " + path + ", error " + std::to_string(GetLastError()));
+            }
+
+            offset += written;
+            data += written;
+            size -= written;
+        }
+    }
+
+    void SegmentFile::Read(uintmax_t offset, unsigned char* data, size_t size) const
+    {
+        while (size > 0) {
+            OVERLAPPED overlapped = {};
+            overlapped.Offset = static_cast<DWORD>(offset & 0xffffffff);
+            overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+            DWORD read = 0;
+            const DWORD toRead = static_cast<DWORD>(std::min(size, static_cast<size_t>(1 << 30)));
+            if (!ReadFile(handle, data, toRead, &read, &overlapped) || read == 0) {
+                throw std::runtime_error("Unable to read segment file " + path + ", error " + std::to_string(GetLastError()));
+            }
+
+            offset += read;
+            data += read;
+            size -= read;
+        }
+    }
+
+#else // _WIN32
+
+    SegmentFile::SegmentFile(const std::string& path, bool writable)
+        : path(path)
+    {
+        fd = writable
+            ? open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)
+            : open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0) {
+            throw std::runtime_error("Unable to open segment file " + path + ": " + strerror(errno));
+        }
+    }
+
+    SegmentFile::~SegmentFile()
+    {
+        close(fd);
+    }
+
+    void SegmentFile::Preallocate(uintmax_t size)
+    {
+#ifdef __linux__
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size)); // just a hint
+#else // __linux__
+        (void) size;
+#endif // __linux__
+    }
+
+    void SegmentFile::Truncate(uintmax_t size)
+    {
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            throw std::runtime_error("Unable to truncate segment file " + path + ": " + strerror(errno));
+        }
+    }
+
+    void SegmentFile::Write(uintmax_t offset, const unsigned char* data, size_t size)
+    {
+        while (size > 0) {
+            const ssize_t written = pwrite(fd, data, size, static_cast<off_t>(offset));
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Unable to write segment file " + path + ": " + strerror(errno));
+            }
+
+            offset += written;
+            data += written;
+            size -= written;
+        }
+    }
+
+    void SegmentFile::Read(uintmax_t offset, unsigned char* data, size_t size) const
+    {
+        while (size > 0) {
+            const ssize_t read = pread(fd, data, size, static_cast<off_t>(offset));
+            if (read <= 0) {
+                if (read < 0 && errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Unable to read segment file " + path + (read < 0 ? std::string(": ") + strerror(errno) : ": unexpected end of file"));
+            }
+
+            offset += read;
+            data += read;
+            size -= read;
+        }
+    }
+
+#endif // _WIN32
+
+}
@@ -0,0 +1,48 @@
+//               Copyright 2017 Juha Reunanen
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef ISTO_SEGMENT_FILE_H
+#define ISTO_SEGMENT_FILE_H
+
+#include <string>
+#include <cstdint>
+
+namespace isto {
+
+    // A large file that contains the payloads of many data items, accessed using positional I/O
+    // - concurrent reads and writes of distinct ranges are fine
+    class SegmentFile {
+    public:
+        SegmentFile(const std::string& path, bool writable);
+        ~SegmentFile();
+
+        SegmentFile(const SegmentFile&) = delete;
+        SegmentFile& operator=(const SegmentFile&) = delete;
+
+        // Reserve disk space up front, without changing the size of the file (if supported by the platform)
+        void Preallocate(uintmax_t size);
+
+        // Release any reserved space beyond the given size
+        void Truncate(uintmax_t size);
+
+        void Write(uintmax_t offset, const unsigned char* data, size_t size);
+        void Read(uintmax_t offset, unsigned char* data, size_t size) const;
+
+        const std::string& GetPath() const { return path; }
+
+    private:
+        const std::string path;
+
+#ifdef _WIN32
+        void* handle;
+#else // _WIN32
+        int fd;
+#endif // _WIN32
+    };
+
+};
+
+#endif // ISTO_SEGMENT_FILE_H
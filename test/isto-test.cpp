@@ -5,9 +5,15 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 
 #include "../isto.h"
+#include <SQLiteCpp/Database.h>
+#include <SQLiteCpp/Statement.h>
+#include "system_clock_time_point_string_conversion/system_clock_time_point_string_conversion.h"
 #include <gtest/gtest.h>
 #include <numeric> // std::iota
 #include <filesystem>
+#include <thread>
+#include <atomic>
+#include <fstream>
 
 namespace fs = std::experimental::filesystem;
 
@@ -100,6 +106,92 @@ namespace {
         EXPECT_EQ(retrievedDataItem.timestamp, sampleDataItem->timestamp);
     }
 
+    TEST_F(IstoTest, SharesPayloadWithoutCopying) {
+        std::vector<unsigned char> data(sampleDataItem->data.begin(), sampleDataItem->data.end());
+        const unsigned char* originalBuffer = data.data();
+
+        const isto::DataItem dataItem(sampleDataId, std::move(data));
+        EXPECT_EQ(dataItem.data.data(), originalBuffer);
+
+        const isto::DataItem copiedDataItem = dataItem;
+        EXPECT_EQ(copiedDataItem.data.data(), originalBuffer);
+
+        const isto::DataItem derivedDataItem(dataItem.id, dataItem.data, dataItem.timestamp, true);
+        EXPECT_EQ(derivedDataItem.data.data(), originalBuffer);
+        EXPECT_EQ(derivedDataItem.data, sampleDataItem->data);
+    }
+
+    TEST_F(IstoTest, ReadsDataViews) {
+        storage->SaveData(*sampleDataItem);
+
+        const isto::DataView dataView = storage->GetDataView(sampleDataId);
+
+        EXPECT_TRUE(dataView.isValid);
+        EXPECT_EQ(dataView.id, sampleDataItem->id);
+        EXPECT_EQ(dataView.data, sampleDataItem->data);
+        EXPECT_EQ(dataView.timestamp, sampleDataItem->timestamp);
+        EXPECT_FALSE(storage->GetDataView("does-not-exist.bin").isValid);
+    }
+
+    TEST_F(IstoTest, KeepsDataViewsIntactWhenUpserting) {
+        storage->SaveData(*sampleDataItem);
+
+        const isto::DataView dataView = storage->GetDataView(sampleDataId);
+
+        const std::vector<unsigned char> newData(100, 42);
+        storage->SaveData(isto::DataItem(sampleDataId, newData), true);
+
+        // The view still maps the old file
+        EXPECT_EQ(dataView.data, sampleDataItem->data);
+        EXPECT_EQ(storage->GetData(sampleDataId).data, newData);
+    }
+
+    TEST_F(IstoTest, ReadsDataViewsFromSegmentFiles) {
+        configuration.useSegmentFiles = true;
+        RecreateStorageWithUpdatedConfiguration();
+
+        SaveSequentialData(10);
+
+        for (int i = 0; i < 10; ++i) {
+            EXPECT_EQ(storage->GetDataView(std::to_string(i) + ".bin").data, sampleDataItem->data);
+        }
+    }
+
+    TEST_F(IstoTest, ServesRecentDataFromHotItemCache) {
+        configuration.hotItemCacheSizeInMiB = 1.0;
+        RecreateStorageWithUpdatedConfiguration();
+
+        storage->SaveData(*sampleDataItem);
+
+        // Remove the payload behind the storage's back: a cached item can still be served
+        for (const auto& entry : fs::recursive_directory_iterator(configuration.rotatingDirectory)) {
+            if (entry.path().filename() == sampleDataId) {
+                fs::remove(entry.path());
+                break;
+            }
+        }
+
+        EXPECT_EQ(storage->GetData(sampleDataId).data, sampleDataItem->data);
+
+        const isto::DataItem upsertedDataItem(sampleDataId, std::string("new data"));
+        storage->SaveData(upsertedDataItem, true);
+        EXPECT_EQ(storage->GetData(sampleDataId).data, upsertedDataItem.data);
+
+        storage->MakePermanent(sampleDataId);
+        EXPECT_TRUE(storage->GetData(sampleDataId).isPermanent);
+    }
+
+    TEST_F(IstoTest, DoesNotServeRemovedExcessDataFromHotItemCache) {
+        configuration.hotItemCacheSizeInMiB = 1.0;
+        configuration.maxRotatingDataToKeepInGiB = 10 * 4096 / (1024.0 * 1024.0 * 1024.0);
+        RecreateStorageWithUpdatedConfiguration();
+
+        SaveSequentialData(20);
+
+        EXPECT_FALSE(storage->GetData("0.bin").isValid);
+        EXPECT_TRUE(storage->GetData("19.bin").isValid);
+    }
+
     TEST_F(IstoTest, SavesAndReadsTags) {
         configuration.tags.push_back("test");
         configuration.tags.push_back("test2");
@@ -118,6 +210,77 @@ namespace {
         EXPECT_EQ(readItem.tags, taggedItem.tags);
     };
 
+    TEST_F(IstoTest, HandlesQuotesInIdsAndTags) {
+        configuration.tags = { "camera" };
+        RecreateStorageWithUpdatedConfiguration();
+
+        const std::string id = "it's.bin";
+        const isto::tags_t tags = { { "camera", "'1'" } };
+        storage->SaveData(isto::DataItem(id, sampleDataItem->data, isto::now(), false, tags));
+
+        EXPECT_EQ(storage->GetData(id).data, sampleDataItem->data);
+        EXPECT_EQ(storage->GetData(isto::now(), "<=", tags).id, id);
+
+        EXPECT_TRUE(storage->MakePermanent(id));
+        EXPECT_TRUE(storage->GetData(id).isPermanent);
+    }
+
+    TEST_F(IstoTest, SavesAndReadsDynamicTags) {
+        configuration.useDynamicTags = true;
+        RecreateStorageWithUpdatedConfiguration();
+
+        const auto now = isto::now();
+
+        const isto::tags_t tags1 = { { "camera", "1" }, { "class", "car" } };
+        const isto::tags_t tags2 = { { "camera", "2" }, { "class", "car" }, { "a new tag", "it's here" } };
+
+        storage->SaveData(isto::DataItem("1.bin", sampleDataItem->data, now - std::chrono::microseconds(2), false, tags1));
+        storage->SaveData(isto::DataItem("2.bin", sampleDataItem->data, now - std::chrono::microseconds(1), true, tags2));
+
+        EXPECT_EQ(storage->GetData("1.bin").tags, tags1);
+        EXPECT_EQ(storage->GetData("2.bin").tags, tags2);
+
+        EXPECT_EQ(storage->GetData(now, "<=", { { "camera", "1" } }).id, "1.bin");
+        EXPECT_EQ(storage->GetData(now, "<=", { { "a new tag", "it's here" } }).id, "2.bin");
+        EXPECT_FALSE(storage->GetData(now, "<=", { { "camera", "3" } }).isValid);
+        EXPECT_EQ(storage->GetDataItems(isto::timestamp_t(), now, { { "class", "car" } }).size(), 2);
+
+        // Upserting replaces the tags
+        const isto::tags_t tags3 = { { "camera", "3" } };
+        storage->SaveData(isto::DataItem("1.bin", sampleDataItem->data, now - std::chrono::microseconds(2), false, tags3), true);
+        EXPECT_EQ(storage->GetData("1.bin").tags, tags3);
+        EXPECT_FALSE(storage->GetData(now, "<=", { { "class", "car" }, { "camera", "1" } }).isValid);
+
+        // Moving keeps the tags
+        EXPECT_TRUE(storage->MakePermanent("1.bin"));
+        RecreateStorageWithUpdatedConfiguration();
+        EXPECT_EQ(storage->GetData("1.bin").tags, tags3);
+        EXPECT_EQ(storage->GetData(now, "<=", { { "camera", "3" } }).id, "1.bin");
+    }
+
+    TEST_F(IstoTest, KeepsDynamicTagsWhenRowidsChange) {
+        configuration.useDynamicTags = true;
+        RecreateStorageWithUpdatedConfiguration();
+
+        const isto::tags_t tags = { { "camera", "1" } };
+        storage->SaveData(isto::DataItem("1.bin", sampleDataItem->data, isto::now(), false, tags));
+        storage->SaveData(isto::DataItem("2.bin", sampleDataItem->data, isto::now(), false));
+        storage.reset();
+
+        {
+            // As a vacuum, or a rebuild of the table, might do
+            SQLite::Database db((fs::path(configuration.rotatingDirectory) / "isto_rotating.sqlite").string(), SQLITE_OPEN_READWRITE);
+            db.exec("update DataItems set rowid = rowid + 100");
+            db.exec("update DataItems set rowid = 203 - rowid - 100"); // swapped
+        }
+
+        RecreateStorageWithUpdatedConfiguration();
+
+        EXPECT_EQ(storage->GetData("1.bin").tags, tags);
+        EXPECT_TRUE(storage->GetData("2.bin").tags.empty());
+        EXPECT_EQ(storage->GetDataItems(isto::timestamp_t(), isto::now(), tags).size(), 1);
+    }
+
     TEST_F(IstoTest, DoesNotAllowSpacesInTagNames) {
         configuration.tags.push_back("test tag");
         EXPECT_THROW(RecreateStorageWithUpdatedConfiguration(), std::exception);
@@ -143,6 +306,32 @@ namespace {
         EXPECT_NE(storage->GetData(sampleDataId).data, sampleDataItem->data);
     }
 
+    TEST_F(IstoTest, SavesDataAsynchronously) {
+        std::vector<std::future<bool>> saved;
+        for (int i = 0; i < 10; ++i) {
+            saved.push_back(storage->SaveDataAsync(isto::DataItem(std::to_string(i) + ".bin", sampleDataItem->data)));
+        }
+        for (auto& future : saved) {
+            EXPECT_TRUE(future.get());
+        }
+        EXPECT_EQ(storage->GetIdsSortedByAscendingTimestamp().size(), 10);
+        EXPECT_EQ(storage->GetData("9.bin").data, sampleDataItem->data);
+    }
+
+    TEST_F(IstoTest, ReportsAsyncSaveErrorsViaFuture) {
+        EXPECT_TRUE(storage->SaveDataAsync(*sampleDataItem).get());
+        auto duplicate = storage->SaveDataAsync(*sampleDataItem);
+        EXPECT_THROW(duplicate.get(), std::exception);
+    }
+
+    TEST_F(IstoTest, SavesQueuedAsyncDataBeforeDestruction) {
+        for (int i = 0; i < 10; ++i) {
+            storage->SaveDataAsync(isto::DataItem(std::to_string(i) + ".bin", sampleDataItem->data));
+        }
+        RecreateStorageWithUpdatedConfiguration();
+        EXPECT_EQ(storage->GetIdsSortedByAscendingTimestamp().size(), 10);
+    }
+
     TEST_F(IstoTest, MakesPermanentAndRotating) {
         storage->SaveData(*sampleDataItem);
         EXPECT_TRUE(storage->MakePermanent(sampleDataItem->id));
@@ -160,6 +349,21 @@ namespace {
         EXPECT_EQ(retrievedDataItem.id, sampleDataItem->id);
     }    
 
+    TEST_F(IstoTest, PersistsDataWhenCommittingInGroups) {
+        configuration.commitIntervalItems = 100;
+        configuration.commitIntervalMilliseconds = 60 * 1000;
+        RecreateStorageWithUpdatedConfiguration();
+
+        SaveSequentialData(5);
+        storage->Flush();
+        SaveSequentialData(5);
+        EXPECT_EQ(storage->GetIdsSortedByAscendingTimestamp().size(), 10);
+
+        RecreateStorageWithUpdatedConfiguration();
+        EXPECT_EQ(storage->GetIdsSortedByAscendingTimestamp().size(), 10);
+        EXPECT_TRUE(storage->GetData("9.bin").isValid);
+    }
+
     TEST_F(IstoTest, ServesIdsOfSavedData) {
         SaveSequentialData(10);
         const auto ids = storage->GetIdsSortedByAscendingTimestamp();
@@ -226,6 +430,37 @@ namespace {
         EXPECT_TRUE(storage->GetData("39.bin").isValid);
     }
 
+    TEST_F(IstoTest, ResyncsEstimatedFreeDiskSpaceNearLimit) {
+        const double bytesPerMiB = 1024.0 * 1024.0, bytesPerGiB = 1024.0 * bytesPerMiB;
+        const auto space = fs::space(fs::path(configuration.rotatingDirectory));
+
+        // The periodic check is never due, so only the safety margin can trigger a re-sync
+        configuration.freeDiskSpaceCheckIntervalSeconds = 3600.0;
+        configuration.freeDiskSpaceSafetyMarginInGiB = 64 * bytesPerMiB / bytesPerGiB;
+        configuration.minFreeDiskSpaceInGiB = (space.free - 16 * bytesPerMiB) / bytesPerGiB;
+        RecreateStorageWithUpdatedConfiguration();
+
+        SaveSequentialData(3);
+        EXPECT_TRUE(storage->GetData("0.bin").isValid);
+
+        // Use up the remaining space behind the storage's back, so that the estimate no longer holds
+        const fs::path filler = fs::path(configuration.permanentDirectory) / "filler.bin";
+        {
+            std::ofstream out(filler.string(), std::ios::binary);
+            const std::vector<char> block(static_cast<size_t>(bytesPerMiB));
+            for (int i = 0; i < 32; ++i) {
+                out.write(block.data(), block.size());
+            }
+        }
+
+        SaveSequentialData(1);
+
+        fs::remove(filler);
+
+        EXPECT_FALSE(storage->GetData("0.bin").isValid);
+        EXPECT_FALSE(storage->GetData("3.bin").isValid);
+    }
+
     TEST_F(IstoTest, DoesNotSaveRotatingIfHardDiskAlreadyFull) {
         const auto space = fs::space(fs::path(configuration.rotatingDirectory));
 
@@ -366,6 +601,35 @@ namespace {
         EXPECT_EQ(latestDataItem.tags, tags2);
     }
 
+    TEST_F(IstoTest, GetsDataByTagsUsingTagIndexes) {
+        configuration.tags = { "camera", "label" };
+        configuration.tagIndexes = { { "camera" }, { "camera", "label" } };
+        RecreateStorageWithUpdatedConfiguration();
+
+        const auto now = isto::now();
+
+        for (int i = 0; i < 10; ++i) {
+            const isto::tags_t tags = { { "camera", std::to_string(i % 2) }, { "label", "x" } };
+            storage->SaveData(isto::DataItem(std::to_string(i) + ".bin", sampleDataItem->data, now - std::chrono::microseconds(10 - i), false, tags));
+        }
+
+        EXPECT_EQ(storage->GetData(now, "<=", { { "camera", "0" } }).id, "8.bin");
+        EXPECT_EQ(storage->GetDataItems(isto::timestamp_t(), now, { { "camera", "1" }, { "label", "x" } }).size(), 5);
+
+        // Dropping the indexes does not affect the results
+        configuration.tagIndexes.clear();
+        RecreateStorageWithUpdatedConfiguration();
+
+        EXPECT_EQ(storage->GetData(now, "<=", { { "camera", "0" } }).id, "8.bin");
+    }
+
+    TEST_F(IstoTest, DoesNotAllowTagIndexesOnUnknownTags) {
+        configuration.tags = { "camera" };
+        configuration.tagIndexes = { { "label" } };
+        storage.reset();
+        EXPECT_THROW(storage.reset(new isto::Storage(configuration)), std::exception);
+    }
+
     TEST_F(IstoTest, GetsPreviousAndNextDataByTags) {
 
         configuration.tags.push_back("test");
@@ -525,6 +789,695 @@ namespace {
         }
     }
 
+    TEST_F(IstoTest, GetsMetadataWithoutPayloads) {
+        configuration.tags = { "camera" };
+        RecreateStorageWithUpdatedConfiguration();
+
+        const auto now = isto::now();
+
+        const int totalItemCount = 10;
+        for (int i = 0; i < totalItemCount; ++i) {
+            const isto::tags_t tags = { { "camera", std::to_string(i % 2) } };
+            const isto::DataItem dataItem(std::to_string(i + 1) + ".bin", sampleDataItem->data, now - std::chrono::microseconds(totalItemCount - i), i == 0, tags);
+            storage->SaveData(dataItem);
+        }
+
+        const auto metadataItems = storage->GetMetadataItems(isto::timestamp_t(), now, { { "camera", "0" } }, 1000, isto::Order::Ascending);
+        ASSERT_EQ(metadataItems.size(), totalItemCount / 2);
+
+        const isto::DataItemMetadata& first = metadataItems.front();
+        EXPECT_EQ(first.id, "1.bin");
+        EXPECT_TRUE(first.isPermanent);
+        EXPECT_EQ(first.size, sampleDataItem->data.size());
+        EXPECT_EQ(first.tags.at("camera"), "0");
+        EXPECT_EQ(first.timestamp, storage->GetData("1.bin").timestamp);
+
+        for (const auto& metadata : metadataItems) {
+            const isto::DataItem dataItem = storage->GetData(metadata);
+            EXPECT_EQ(dataItem.id, metadata.id);
+            EXPECT_EQ(dataItem.data, sampleDataItem->data);
+        }
+    }
+
+    TEST_F(IstoTest, WalksDataItemsOneAtATime) {
+        const auto now = isto::now();
+
+        const int totalItemCount = 250; // more than fit on a single page
+        for (int i = 0; i < totalItemCount; ++i) {
+            const bool isPermanent = i % 3 == 0;
+            const isto::DataItem dataItem(std::to_string(i + 1) + ".bin", sampleDataItem->data, now - std::chrono::microseconds(totalItemCount - i), isPermanent);
+            storage->SaveData(dataItem);
+        }
+
+        for (const auto order : { isto::Order::Ascending, isto::Order::Descending }) {
+            isto::Storage::Query query(*storage, isto::timestamp_t(), now, isto::tags_t(), order, 3);
+
+            std::vector<isto::timestamp_t> timestamps;
+            while (true) {
+                const isto::DataItem dataItem = query.Next();
+                if (!dataItem.isValid) {
+                    break;
+                }
+                EXPECT_EQ(dataItem.data, sampleDataItem->data);
+                timestamps.push_back(dataItem.timestamp);
+            }
+
+            EXPECT_EQ(timestamps.size(), totalItemCount);
+
+            if (order == isto::Order::Ascending) {
+                EXPECT_TRUE(std::is_sorted(timestamps.begin(), timestamps.end()));
+            }
+            else {
+                EXPECT_TRUE(std::is_sorted(timestamps.rbegin(), timestamps.rend()));
+            }
+        }
+
+        { // gets the middle items by exact range
+            isto::Storage::Query query(*storage, now - std::chrono::microseconds(7), now - std::chrono::microseconds(3));
+
+            int count = 0;
+            while (query.Next().isValid) {
+                ++count;
+            }
+            EXPECT_EQ(count, 5);
+        }
+    }
+
+    TEST_F(IstoTest, SavesAndReadsBatchesWithSingleIoThread) {
+        configuration.ioThreadCount = 1;
+        RecreateStorageWithUpdatedConfiguration();
+
+        const auto now = isto::now();
+
+        isto::DataItems dataItems;
+        const int totalItemCount = 50;
+        for (int i = 0; i < totalItemCount; ++i) {
+            dataItems.emplace_back(std::to_string(i) + ".bin", sampleDataItem->data, now - std::chrono::microseconds(totalItemCount - i));
+        }
+        storage->SaveData(dataItems);
+
+        const auto readDataItems = storage->GetDataItems(isto::timestamp_t(), now, isto::tags_t(), totalItemCount, isto::Order::Ascending);
+        ASSERT_EQ(readDataItems.size(), totalItemCount);
+        for (int i = 0; i < totalItemCount; ++i) {
+            EXPECT_EQ(readDataItems[i].id, dataItems[i].id);
+            EXPECT_EQ(readDataItems[i].data, sampleDataItem->data);
+        }
+    }
+
+    TEST_F(IstoTest, SavesAndReadsDataUsingSegmentFiles) {
+        configuration.useSegmentFiles = true;
+        RecreateStorageWithUpdatedConfiguration();
+
+        SaveSequentialData(5);
+        RecreateStorageWithUpdatedConfiguration(); // should continue the existing segment
+        SaveSequentialData(5);
+
+        for (int i = 0; i < 10; ++i) {
+            const auto dataItem = storage->GetData(std::to_string(i) + ".bin");
+            EXPECT_TRUE(dataItem.isValid);
+            EXPECT_EQ(dataItem.data, sampleDataItem->data);
+        }
+
+        EXPECT_TRUE(storage->MakePermanent("3.bin"));
+        EXPECT_TRUE(storage->GetData("3.bin").isPermanent);
+        EXPECT_EQ(storage->GetData("3.bin").data, sampleDataItem->data);
+        EXPECT_EQ(storage->GetData("4.bin").data, sampleDataItem->data);
+
+        size_t fileCount = 0;
+        for (const auto& entry : fs::recursive_directory_iterator(configuration.rotatingDirectory)) {
+            if (fs::is_regular_file(entry.path()) && entry.path().extension() != ".sqlite") {
+                ++fileCount;
+            }
+        }
+        EXPECT_LE(fileCount, 2);
+    }
+
+    TEST_F(IstoTest, RemovesExcessDataUsingSegmentFiles) {
+        configuration.useSegmentFiles = true;
+        configuration.segmentFileSizeInMiB = 8.0 / 1024; // 8 kiB, or two items
+        configuration.maxRotatingDataToKeepInGiB = 16.0 / 1024 / 1024; // 16 kiB
+        RecreateStorageWithUpdatedConfiguration();
+
+        SaveSequentialData(10);
+
+        EXPECT_FALSE(storage->GetData("0.bin").isValid);
+        EXPECT_FALSE(storage->GetData("1.bin").isValid);
+        EXPECT_TRUE(storage->GetData("8.bin").isValid);
+        EXPECT_EQ(storage->GetData("9.bin").data, sampleDataItem->data);
+
+        size_t segmentFileCount = 0;
+        for (const auto& entry : fs::recursive_directory_iterator(configuration.rotatingDirectory)) {
+            if (fs::is_regular_file(entry.path()) && entry.path().extension() != ".sqlite") {
+                ++segmentFileCount;
+            }
+        }
+        EXPECT_LE(segmentFileCount, 3);
+    }
+
+    TEST_F(IstoTest, CountsSegmentDataMadeRotatingOnlyOnce) {
+        configuration.useSegmentFiles = true;
+        configuration.maxRotatingDataToKeepInGiB = 16.0 / 1024 / 1024; // 16 kiB, or four items
+        RecreateStorageWithUpdatedConfiguration();
+
+        const auto past = isto::now() - std::chrono::hours(1);
+        storage->SaveData(isto::DataItem("permanent0.bin", sampleDataItem->data, past, true));
+        storage->SaveData(isto::DataItem("permanent1.bin", sampleDataItem->data, past, true));
+
+        EXPECT_TRUE(storage->MakeRotating("permanent0.bin"));
+        EXPECT_TRUE(storage->MakeRotating("permanent1.bin"));
+
+        // Four items in all, so nothing needs to be deleted yet
+        SaveSequentialData(2);
+
+        EXPECT_TRUE(storage->GetData("permanent0.bin").isValid);
+        EXPECT_TRUE(storage->GetData("permanent1.bin").isValid);
+        EXPECT_TRUE(storage->GetData("1.bin").isValid);
+
+        SaveSequentialData(1);
+
+        EXPECT_FALSE(storage->GetData("permanent0.bin").isValid);
+        EXPECT_TRUE(storage->GetData("permanent1.bin").isValid);
+    }
+
+    TEST_F(IstoTest, RemovesExpiredDirectoriesAsWhole) {
+        configuration.maxRotatingDataToKeepInGiB = 10 * 4096 / (1024.0 * 1024.0 * 1024.0);
+        configuration.deletionFlushInterval = 4;
+        RecreateStorageWithUpdatedConfiguration();
+
+        // Two items per minute
+        const auto start = isto::now() - std::chrono::hours(1);
+        fs::path untrackedFile;
+
+        for (int i = 0; i < 20; ++i) {
+            const auto timestamp = start + std::chrono::minutes(i / 2) + std::chrono::seconds(i % 2);
+            storage->SaveData(isto::DataItem(std::to_string(i) + ".bin", sampleDataItem->data, timestamp));
+
+            if (i == 0) {
+                // A file that the storage does not know about goes only if the whole directory is removed
+                for (const auto& entry : fs::recursive_directory_iterator(configuration.rotatingDirectory)) {
+                    if (entry.path().filename() == "0.bin") {
+                        untrackedFile = entry.path().parent_path() / "untracked.txt";
+                        std::ofstream(untrackedFile.string()) << "x";
+                        break;
+                    }
+                }
+                ASSERT_TRUE(fs::exists(untrackedFile));
+            }
+        }
+
+        EXPECT_FALSE(fs::exists(untrackedFile));
+        EXPECT_FALSE(fs::exists(untrackedFile.parent_path()));
+        EXPECT_FALSE(storage->GetData("9.bin").isValid);
+        EXPECT_TRUE(storage->GetData("10.bin").isValid);
+        EXPECT_EQ(storage->GetData("19.bin").data, sampleDataItem->data);
+
+        size_t fileCount = 0, emptyDirectoryCount = 0;
+        for (const auto& entry : fs::recursive_directory_iterator(configuration.rotatingDirectory)) {
+            if (fs::is_regular_file(entry.path()) && entry.path().extension() != ".sqlite") {
+                ++fileCount;
+            }
+            else if (fs::is_directory(entry.path()) && fs::is_empty(entry.path())) {
+                ++emptyDirectoryCount;
+            }
+        }
+        EXPECT_EQ(fileCount, 10);
+        EXPECT_EQ(emptyDirectoryCount, 0);
+    }
+
+    TEST_F(IstoTest, RemovesDataExceedingTagQuotas) {
+        configuration.tags = { "camera" };
+        configuration.rotatingDataQuotas.push_back({ "camera", "1", 3 * 4096 / (1024.0 * 1024.0 * 1024.0) });
+        configuration.rotatingDataQuotas.push_back({ "camera", "2", 0.0, 1.0 });
+        RecreateStorageWithUpdatedConfiguration();
+
+        const auto start = isto::now() - std::chrono::hours(2);
+        for (int i = 0; i < 10; ++i) {
+            const isto::tags_t tags = { { "camera", i % 2 == 0 ? "1" : "2" } };
+            const auto timestamp = i < 2 ? start : isto::now();
+            storage->SaveData(isto::DataItem(std::to_string(i) + ".bin", sampleDataItem->data, timestamp, false, tags));
+        }
+
+        // camera 1: only the three most recent items
+        EXPECT_FALSE(storage->GetData("0.bin").isValid);
+        EXPECT_FALSE(storage->GetData("2.bin").isValid);
+        EXPECT_TRUE(storage->GetData("4.bin").isValid);
+        EXPECT_TRUE(storage->GetData("8.bin").isValid);
+
+        // camera 2: only the items that are not too old
+        EXPECT_FALSE(storage->GetData("1.bin").isValid);
+        EXPECT_TRUE(storage->GetData("3.bin").isValid);
+        EXPECT_TRUE(storage->GetData("9.bin").isValid);
+    }
+
+    TEST_F(IstoTest, MakesBatchesPermanent) {
+        SaveSequentialData(5);
+
+        EXPECT_EQ(storage->MakePermanent(std::vector<std::string>{ "1.bin", "3.bin", "no-such-id" }), 2);
+
+        for (int i = 0; i < 5; ++i) {
+            const auto dataItem = storage->GetData(std::to_string(i) + ".bin");
+            EXPECT_EQ(dataItem.isPermanent, i == 1 || i == 3);
+            EXPECT_EQ(dataItem.data, sampleDataItem->data);
+        }
+
+        size_t rotatingFileCount = 0;
+        for (const auto& entry : fs::recursive_directory_iterator(configuration.rotatingDirectory)) {
+            if (fs::is_regular_file(entry.path()) && entry.path().extension() != ".sqlite") {
+                ++rotatingFileCount;
+            }
+        }
+        EXPECT_EQ(rotatingFileCount, 3);
+    }
+
+    TEST_F(IstoTest, MakesPinnedDataPermanent) {
+        configuration.maxRotatingDataToKeepInGiB = 8.0 / 1024 / 1024; // 8 kiB
+        RecreateStorageWithUpdatedConfiguration();
+
+        SaveSequentialData(1);
+        EXPECT_TRUE(storage->Pin("0.bin"));
+        EXPECT_FALSE(storage->Pin("no-such-id"));
+        EXPECT_FALSE(storage->GetData("0.bin").isPermanent);
+
+        // Make it so that some data will be deleted
+        SaveSequentialData(10);
+
+        EXPECT_TRUE(storage->GetData("0.bin").isPermanent);
+        EXPECT_EQ(storage->GetData("0.bin").data, sampleDataItem->data);
+        EXPECT_FALSE(storage->GetData("1.bin").isValid);
+    }
+
+    TEST_F(IstoTest, DeletesNewerDataPastPinnedDataThatCannotBeMadePermanent) {
+        configuration.maxRotatingDataToKeepInGiB = 12.0 / 1024 / 1024; // 12 kiB, or three items
+        RecreateStorageWithUpdatedConfiguration();
+
+        // A permanent item of the same id keeps the pinned item from being made permanent
+        const auto past = isto::now() - std::chrono::hours(1);
+        storage->SaveData(isto::DataItem("pinned.bin", sampleDataItem->data, past, false));
+        storage->SaveData(isto::DataItem("pinned.bin", sampleDataItem->data, past, true));
+        RecreateStorageWithUpdatedConfiguration(); // recounts the rotating data, which the permanent save may have added to
+        EXPECT_TRUE(storage->Pin("pinned.bin"));
+
+        SaveSequentialData(5);
+
+        EXPECT_FALSE(storage->GetData("0.bin").isValid);
+        EXPECT_FALSE(storage->GetData("1.bin").isValid);
+        EXPECT_FALSE(storage->GetData("2.bin").isValid);
+        EXPECT_TRUE(storage->GetData("3.bin").isValid);
+        EXPECT_TRUE(storage->GetData("4.bin").isValid);
+    }
+
+    TEST_F(IstoTest, MovesOldDataToLowerTiers) {
+        const auto tier0 = fs::path(configuration.rotatingDirectory) / "tier0";
+        const auto tier1 = fs::path(configuration.rotatingDirectory) / "tier1";
+
+        configuration.rotatingTiers.push_back({ tier0.string(), 3 * 4096 / (1024.0 * 1024.0 * 1024.0) });
+        configuration.rotatingTiers.push_back({ tier1.string() });
+        RecreateStorageWithUpdatedConfiguration();
+
+        SaveSequentialData(10);
+
+        const auto countFiles = [](const fs::path& directory) {
+            size_t fileCount = 0;
+            for (const auto& entry : fs::recursive_directory_iterator(directory)) {
+                if (fs::is_regular_file(entry.path())) {
+                    ++fileCount;
+                }
+            }
+            return fileCount;
+        };
+
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (countFiles(tier0) > 3 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        EXPECT_EQ(countFiles(tier0), 3);
+        EXPECT_EQ(countFiles(tier1), 7);
+
+        for (int i = 0; i < 10; ++i) {
+            EXPECT_EQ(storage->GetData(std::to_string(i) + ".bin").data, sampleDataItem->data);
+        }
+    }
+
+    TEST_F(IstoTest, KeepsMigratedDataInItsTierWhenUpserting) {
+        const auto tier0 = fs::path(configuration.rotatingDirectory) / "tier0";
+        const auto tier1 = fs::path(configuration.rotatingDirectory) / "tier1";
+
+        configuration.rotatingTiers.push_back({ tier0.string(), 3 * 4096 / (1024.0 * 1024.0 * 1024.0) });
+        configuration.rotatingTiers.push_back({ tier1.string() });
+        RecreateStorageWithUpdatedConfiguration();
+
+        SaveSequentialData(10);
+
+        const auto countFiles = [](const fs::path& directory) {
+            size_t fileCount = 0;
+            for (const auto& entry : fs::recursive_directory_iterator(directory)) {
+                if (fs::is_regular_file(entry.path())) {
+                    ++fileCount;
+                }
+            }
+            return fileCount;
+        };
+
+        const auto waitForMigration = [&]() {
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+            while (countFiles(tier0) > 3 && std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        };
+
+        waitForMigration();
+        ASSERT_EQ(countFiles(tier1), 7);
+
+        // The oldest item is now in tier 1 - it must stay there, and not be migrated again onto itself
+        const auto migrated = storage->GetData("0.bin");
+        std::vector<unsigned char> newData(migrated.data.size(), 0x42);
+        storage->SaveData(isto::DataItem("0.bin", newData, migrated.timestamp), true);
+
+        SaveSequentialData(1);
+        waitForMigration();
+
+        EXPECT_EQ(countFiles(tier0), 3);
+        EXPECT_EQ(countFiles(tier1), 8);
+
+        const auto upserted = storage->GetData("0.bin");
+        ASSERT_TRUE(upserted.isValid);
+        EXPECT_EQ(upserted.data, newData);
+
+        for (int i = 1; i < 11; ++i) {
+            EXPECT_EQ(storage->GetData(std::to_string(i) + ".bin").data, sampleDataItem->data);
+        }
+    }
+
+    TEST_F(IstoTest, StripesDataAcrossDirectories) {
+        const auto stripe0 = fs::path(configuration.rotatingDirectory) / "stripe0";
+        const auto stripe1 = fs::path(configuration.rotatingDirectory) / "stripe1";
+
+        configuration.rotatingStripes = { stripe0.string(), stripe1.string() };
+        configuration.maxRotatingDataToKeepInGiB = 6 * 4096 / (1024.0 * 1024.0 * 1024.0);
+        RecreateStorageWithUpdatedConfiguration();
+
+        SaveSequentialData(10);
+
+        const auto countFiles = [](const fs::path& directory) {
+            size_t fileCount = 0;
+            for (const auto& entry : fs::recursive_directory_iterator(directory)) {
+                if (fs::is_regular_file(entry.path())) {
+                    ++fileCount;
+                }
+            }
+            return fileCount;
+        };
+
+        EXPECT_EQ(countFiles(stripe0), 3);
+        EXPECT_EQ(countFiles(stripe1), 3);
+
+        EXPECT_FALSE(storage->GetData("3.bin").isValid);
+        for (int i = 4; i < 10; ++i) {
+            EXPECT_EQ(storage->GetData(std::to_string(i) + ".bin").data, sampleDataItem->data);
+        }
+    }
+
+    TEST_F(IstoTest, MovesStripedFileWhenUpsertedWithNewTimestamp) {
+        const auto stripe0 = fs::path(configuration.rotatingDirectory) / "stripe0";
+        const auto stripe1 = fs::path(configuration.rotatingDirectory) / "stripe1";
+
+        configuration.rotatingStripes = { stripe0.string(), stripe1.string() };
+        configuration.maxRotatingDataToKeepInGiB = 4 * 4096 / (1024.0 * 1024.0 * 1024.0);
+        RecreateStorageWithUpdatedConfiguration();
+
+        const auto anHourAgo = isto::now() - std::chrono::hours(1);
+        for (const char* id : { "a.bin", "b.bin", "c.bin" }) {
+            storage->SaveData(isto::DataItem(id, sampleDataItem->data, anHourAgo));
+        }
+
+        storage->SaveData(isto::DataItem("a.bin", sampleDataItem->data, isto::now()), true);
+
+        // Deleting b and c empties the old directory of a, which is then removed as a whole
+        for (const char* id : { "d.bin", "e.bin", "f.bin" }) {
+            storage->SaveData(isto::DataItem(id, sampleDataItem->data));
+        }
+
+        EXPECT_FALSE(storage->GetData("b.bin").isValid);
+        EXPECT_FALSE(storage->GetData("c.bin").isValid);
+        for (const char* id : { "a.bin", "d.bin", "e.bin", "f.bin" }) {
+            EXPECT_EQ(storage->GetData(id).data, sampleDataItem->data);
+        }
+
+        size_t fileCount = 0;
+        for (const auto& stripe : { stripe0, stripe1 }) {
+            for (const auto& entry : fs::recursive_directory_iterator(stripe)) {
+                if (fs::is_regular_file(entry.path())) {
+                    ++fileCount;
+                }
+            }
+        }
+        EXPECT_EQ(fileCount, 4);
+    }
+
+    TEST_F(IstoTest, ReadsConcurrentlyWhileSaving) {
+        configuration.readConnectionCount = 2;
+        configuration.maxRotatingDataToKeepInGiB = 50 * 4096 / (1024.0 * 1024.0 * 1024.0);
+        RecreateStorageWithUpdatedConfiguration();
+
+        std::atomic<int> savedCount(0);
+        std::atomic<bool> readsOk(true);
+
+        const auto read = [&]() {
+            while (savedCount < 200) {
+                const int saved = savedCount;
+                if (saved > 0) {
+                    const isto::DataItem d = storage->GetData(std::to_string(saved - 1) + ".bin");
+                    const bool mayHaveBeenEvicted = savedCount >= saved + 49; // only 50 items are kept
+                    if ((!d.isValid && !mayHaveBeenEvicted) || (d.isValid && d.data != sampleDataItem->data)) {
+                        readsOk = false;
+                    }
+                }
+                for (const auto& dataItem : storage->GetDataItems(isto::timestamp_t(), std::chrono::system_clock::now(), isto::tags_t(), 10)) {
+                    if (dataItem.isValid && dataItem.data != sampleDataItem->data) {
+                        readsOk = false;
+                    }
+                }
+            }
+        };
+
+        std::vector<std::thread> readers;
+        for (int i = 0; i < 4; ++i) {
+            readers.emplace_back(read);
+        }
+
+        for (int i = 0; i < 200; ++i) {
+            SaveSequentialData(1);
+            ++savedCount;
+        }
+
+        for (auto& reader : readers) {
+            reader.join();
+        }
+
+        EXPECT_TRUE(readsOk);
+        EXPECT_TRUE(storage->GetData("199.bin").isValid);
+        EXPECT_FALSE(storage->GetData("0.bin").isValid);
+    }
+
+    TEST_F(IstoTest, AttachesReadOnlyToStorageOwnedByAnother) {
+        configuration.readConnectionCount = 1;
+        RecreateStorageWithUpdatedConfiguration();
+
+        storage->SaveData(*sampleDataItem);
+
+        isto::Configuration readerConfiguration = configuration;
+        readerConfiguration.readOnly = true;
+        isto::Storage reader(readerConfiguration);
+
+        EXPECT_EQ(reader.GetData(sampleDataId).data, sampleDataItem->data);
+        EXPECT_THROW(reader.SaveData(isto::DataItem("new.bin", sampleDataItem->data)), std::exception);
+        EXPECT_THROW(reader.MakePermanent(sampleDataId), std::exception);
+
+        // Newly committed items are seen right away
+        SaveSequentialData(3);
+        EXPECT_TRUE(reader.GetData("2.bin").isValid);
+        EXPECT_EQ(reader.GetDataItems().size(), 4);
+
+        storage->MakePermanent("1.bin");
+        EXPECT_TRUE(reader.GetData("1.bin").isPermanent);
+    }
+
+    TEST_F(IstoTest, AttachesReadOnlyToPartitionedStorage) {
+        const auto now = std::chrono::system_clock::now();
+        const auto day = std::chrono::hours(24);
+
+        configuration.rotatingMetadataPartitioning = isto::Configuration::RotatingMetadataPartitioning::Days;
+        RecreateStorageWithUpdatedConfiguration();
+
+        storage->SaveData(isto::DataItem("yesterday.bin", sampleDataItem->data, now - day));
+        storage->SaveData(isto::DataItem("today.bin", sampleDataItem->data, now));
+
+        isto::Configuration readerConfiguration = configuration;
+        readerConfiguration.readOnly = true;
+        isto::Storage reader(readerConfiguration);
+
+        EXPECT_EQ(reader.GetData("yesterday.bin").data, sampleDataItem->data);
+        EXPECT_EQ(reader.GetDataItems().size(), 2);
+        EXPECT_EQ(reader.GetData(now - day, "~").id, "yesterday.bin");
+
+        // A partition that the writer creates later on is found too
+        storage->SaveData(isto::DataItem("last-week.bin", sampleDataItem->data, now - 7 * day));
+        std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+
+        EXPECT_TRUE(reader.GetData("last-week.bin").isValid);
+        EXPECT_EQ(reader.GetDataItems().size(), 3);
+    }
+
+    TEST_F(IstoTest, PartitionsRotatingMetadataByDay) {
+        const auto now = std::chrono::system_clock::now();
+        const auto day = std::chrono::hours(24);
+
+        // An item saved before the partitioning was enabled
+        storage->SaveData(isto::DataItem("old.bin", sampleDataItem->data, now - 3 * day));
+
+        configuration.rotatingMetadataPartitioning = isto::Configuration::RotatingMetadataPartitioning::Days;
+        configuration.maxRotatingDataToKeepInGiB = 3 * 4096 / (1024.0 * 1024.0 * 1024.0);
+        RecreateStorageWithUpdatedConfiguration();
+
+        storage->SaveData(isto::DataItem("yesterday.bin", sampleDataItem->data, now - day));
+        storage->SaveData(isto::DataItem("today.bin", sampleDataItem->data, now));
+
+        const auto countPartitions = [this]() {
+            size_t count = 0;
+            for (const auto& entry : fs::directory_iterator(configuration.rotatingDirectory)) {
+                const std::string name = entry.path().filename().string();
+                count += name.find("isto_rotating_") == 0 && name.rfind(".sqlite") == name.size() - 7;
+            }
+            return count;
+        };
+
+        EXPECT_EQ(countPartitions(), 3);
+        EXPECT_TRUE(storage->GetData("old.bin").isValid);
+        EXPECT_EQ(storage->GetDataItems().size(), 3);
+        EXPECT_EQ(storage->GetData(now - day, "~").id, "yesterday.bin");
+
+        const auto ids = storage->GetIdsSortedByAscendingTimestamp();
+        ASSERT_EQ(ids.size(), 3);
+        EXPECT_EQ(ids.front(), "old.bin");
+        EXPECT_EQ(ids.back(), "today.bin");
+
+        // The oldest day goes as a whole
+        storage->SaveData(isto::DataItem("new.bin", sampleDataItem->data, now));
+
+        EXPECT_EQ(countPartitions(), 2);
+        EXPECT_FALSE(storage->GetData("old.bin").isValid);
+        EXPECT_TRUE(storage->GetData("yesterday.bin").isValid);
+        EXPECT_TRUE(storage->GetData("new.bin").isValid);
+
+        // An upsert with a new timestamp moves the item to another partition
+        storage->SaveData(isto::DataItem("yesterday.bin", sampleDataItem->data, now + std::chrono::seconds(1)), true);
+
+        const auto idsAfterUpsert = storage->GetIdsSortedByAscendingTimestamp();
+        ASSERT_EQ(idsAfterUpsert.size(), 3);
+        EXPECT_EQ(idsAfterUpsert.back(), "yesterday.bin");
+    }
+
+    TEST_F(IstoTest, ClosesIdleRotatingPartitions) {
+        const auto now = std::chrono::system_clock::now();
+
+        configuration.rotatingMetadataPartitioning = isto::Configuration::RotatingMetadataPartitioning::Days;
+        configuration.idleRotatingPartitionCloseSeconds = 0.0;
+        RecreateStorageWithUpdatedConfiguration();
+
+        storage->SaveData(isto::DataItem("yesterday.bin", sampleDataItem->data, now - std::chrono::hours(24)));
+        storage->SaveData(isto::DataItem("today.bin", sampleDataItem->data, now));
+
+        std::vector<std::string> partitions;
+        for (const auto& entry : fs::directory_iterator(configuration.rotatingDirectory)) {
+            const std::string name = entry.path().filename().string();
+            if (name.find("isto_rotating_") == 0 && name.rfind(".sqlite") == name.size() - 7) {
+                partitions.push_back(entry.path().string());
+            }
+        }
+        std::sort(partitions.begin(), partitions.end());
+        ASSERT_EQ(partitions.size(), 2);
+
+        { // The older partition has been committed, and is no longer locked
+            SQLite::Database db(partitions.front(), SQLITE_OPEN_READWRITE);
+            EXPECT_NO_THROW(db.exec("begin exclusive"));
+            SQLite::Statement query(db, "select count(*) from DataItems");
+            ASSERT_TRUE(query.executeStep());
+            EXPECT_EQ(query.getColumn(0).getInt(), 1);
+            query.reset();
+            db.exec("rollback");
+        }
+
+        { // ... unlike the newest one, which the saves go to
+            SQLite::Database db(partitions.back(), SQLITE_OPEN_READWRITE);
+            EXPECT_THROW(db.exec("begin exclusive"), SQLite::Exception);
+        }
+
+        // Opened again when needed
+        EXPECT_EQ(storage->GetData("yesterday.bin").data, sampleDataItem->data);
+        EXPECT_EQ(storage->GetDataItems().size(), 2);
+    }
+
+    TEST_F(IstoTest, ConvertsTextTimestampsToIntegers) {
+        storage.reset();
+
+        // Recreate the schema of the earlier versions, where the timestamps were stored as text
+        const auto timestamp = std::chrono::time_point_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - std::chrono::hours(1));
+        const std::string path = (fs::path(configuration.rotatingDirectory) / "legacy.bin").string();
+
+        {
+            std::ofstream out(path, std::ios::binary);
+            out.write(reinterpret_cast<const char*>(sampleDataItem->data.data()), sampleDataItem->data.size());
+        }
+
+        {
+            SQLite::Database db((fs::path(configuration.rotatingDirectory) / "isto_rotating.sqlite").string(), SQLITE_OPEN_READWRITE);
+            db.exec("drop table if exists DataItems");
+            db.exec("create table DataItems (id text primary key, timestamp text, path text, size integer)");
+
+            SQLite::Statement insert(db, "insert into DataItems values (@id, @timestamp, @path, @size)");
+            insert.bind(1, "legacy.bin");
+            insert.bind(2, system_clock_time_point_string_conversion::to_string(timestamp));
+            insert.bind(3, path);
+            insert.bind(4, static_cast<int>(sampleDataItem->data.size()));
+            insert.exec();
+        }
+
+        RecreateStorageWithUpdatedConfiguration();
+
+        const isto::DataItem dataItem = storage->GetData("legacy.bin");
+        EXPECT_EQ(dataItem.data, sampleDataItem->data);
+        EXPECT_EQ(dataItem.timestamp, timestamp);
+
+        // The timestamps compare as numbers
+        EXPECT_EQ(storage->GetData(timestamp, "==").id, "legacy.bin");
+        EXPECT_EQ(storage->GetDataItems(timestamp - std::chrono::seconds(1), timestamp + std::chrono::seconds(1)).size(), 1);
+
+        SaveSequentialData(1);
+        EXPECT_EQ(storage->GetIdsSortedByAscendingTimestamp().front(), "legacy.bin");
+    }
+
+    TEST_F(IstoTest, RemovesExcessDataInBackground) {
+        configuration.useBackgroundEviction = true;
+        configuration.maxRotatingDataToKeepInGiB = 10 * 4096 / (1024.0 * 1024.0 * 1024.0);
+        configuration.evictionHighWatermark = 0.8;
+        configuration.evictionLowWatermark = 0.5;
+        configuration.evictionStartFreeDiskPercent = 0.0;
+        configuration.evictionStopFreeDiskPercent = 0.0;
+        RecreateStorageWithUpdatedConfiguration();
+
+        SaveSequentialData(20);
+
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (storage->GetIdsSortedByAscendingTimestamp().size() > 8 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        EXPECT_LE(storage->GetIdsSortedByAscendingTimestamp().size(), 8); // the high watermark
+        EXPECT_FALSE(storage->GetData("0.bin").isValid);
+        EXPECT_TRUE(storage->GetData("19.bin").isValid);
+    }
+
     TEST_F(IstoTest, WorksReasonablyWhenPermanentAndRotatingPointToSameDirectory) {
         isto::Configuration sharedConfiguration;
 
@@ -551,6 +1504,7 @@ namespace {
     TEST_F(IstoTest, MakesReadOnlyDataPermanent) {
         // Set up new, tight limits
         configuration.maxRotatingDataToKeepInGiB = 8.0 / 1024 / 1024; // 8 kiB
+        configuration.makeReadOnlyFilesPermanent = true;
 
         // Test both shared and non-shared directory structures
         for (int samePath = 0; samePath <= 1; ++samePath) {
@@ -595,6 +1549,9 @@ namespace {
                 & ~fs::perms::others_write;
             fs::permissions(rotatingPath, newPermissions);
 
+            // The read-only files are looked for when the storage is constructed
+            RecreateStorageWithUpdatedConfiguration();
+
             // Make it so that some files will be deleted
             SaveSequentialData(10);
 
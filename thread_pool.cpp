@@ -0,0 +1,58 @@
+//               Copyright 2017 Juha Reunanen
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "thread_pool.h"
+#include <algorithm> // std::max
+
+namespace isto {
+
+    ThreadPool::ThreadPool(size_t threadCount)
+    {
+        threadCount = std::max(threadCount, static_cast<size_t>(1));
+
+        workerThreads.reserve(threadCount);
+
+        for (size_t i = 0; i < threadCount; ++i) {
+            workerThreads.emplace_back(&ThreadPool::WorkerThreadMain, this);
+        }
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopRequested = true;
+        }
+
+        taskAvailable.notify_all();
+
+        for (auto& workerThread : workerThreads) {
+            workerThread.join(); // any tasks still queued are run before the threads exit
+        }
+    }
+
+    void ThreadPool::WorkerThreadMain()
+    {
+        while (true) {
+            std::function<void()> task;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                taskAvailable.wait(lock, [this]() { return !tasks.empty() || stopRequested; });
+
+                if (tasks.empty()) {
+                    return;
+                }
+
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+
+            task(); // any exceptions are stored in the future
+        }
+    }
+
+}
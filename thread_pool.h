@@ -0,0 +1,58 @@
+//               Copyright 2017 Juha Reunanen
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef ISTO_THREAD_POOL_H
+#define ISTO_THREAD_POOL_H
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+
+namespace isto {
+
+    // A fixed number of worker threads, shared by all the file operations of a Storage object
+    // - NB: a task must not wait for another task, or the pool may deadlock
+    class ThreadPool {
+    public:
+        ThreadPool(size_t threadCount);
+        ~ThreadPool();
+
+        template <typename Function>
+        auto Run(Function function) -> std::future<decltype(function())>
+        {
+            typedef decltype(function()) result_t;
+
+            auto task = std::make_shared<std::packaged_task<result_t()>>(std::move(function));
+            auto result = task->get_future();
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                tasks.push_back([task]() { (*task)(); });
+            }
+
+            taskAvailable.notify_one();
+
+            return result;
+        }
+
+    private:
+        void WorkerThreadMain();
+
+        std::vector<std::thread> workerThreads;
+        std::deque<std::function<void()>> tasks;
+        std::mutex mutex;
+        std::condition_variable taskAvailable;
+        bool stopRequested = false;
+    };
+
+};
+
+#endif // ISTO_THREAD_POOL_H